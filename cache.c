@@ -0,0 +1,502 @@
+/*
+ * Content addressed cache for generated images
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each image gets a key that is the SHA-256 of everything that goes into
+ * it: the image's config section, the handler type, the options (including
+ * the identity of the tools), the keys or the content of the child images
+ * and the metadata of the files below the mountpoint.
+ * A generated image is stored as '<cachedir>/<key>' together with
+ * '<key>.info' that contains the resulting image size.
+ */
+
+#include <confuse.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+#include "genimage.h"
+
+static void hash_printf(struct sha256_ctx *ctx, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void hash_printf(struct sha256_ctx *ctx, const char *fmt, ...)
+{
+	va_list args;
+	char *buf;
+
+	va_start(args, fmt);
+	if (vasprintf(&buf, fmt, args) < 0) {
+		error("out of memory\n");
+		exit(1);
+	}
+	va_end(args);
+
+	/* include the terminating '\0' to separate the fields */
+	sha256_update(ctx, buf, strlen(buf) + 1);
+	free(buf);
+}
+
+static char *hash_hex(struct sha256_ctx *ctx)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	char *hex = xzalloc(SHA256_DIGEST_SIZE * 2 + 1);
+	int i;
+
+	sha256_final(ctx, digest);
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+
+	return hex;
+}
+
+/*
+ * Options that name a tool are hashed with the size and mtime of the
+ * binary, so that updating a tool invalidates the cache.
+ */
+static void hash_opt(const char *name, const char *value, void *data)
+{
+	struct sha256_ctx *ctx = data;
+	char *tool, *path, *dir, *p;
+	struct stat s;
+
+	hash_printf(ctx, "opt %s=%s", name, value ?: "");
+
+	if (!value || !*value)
+		return;
+
+	tool = strndupa(value, strcspn(value, " \t"));
+	if (strchr(tool, '/')) {
+		if (!stat(tool, &s))
+			hash_printf(ctx, "tool %lld %lld.%09ld", (long long)s.st_size,
+				    (long long)s.st_mtim.tv_sec, s.st_mtim.tv_nsec);
+		return;
+	}
+
+	path = getenv("PATH");
+	if (!path)
+		return;
+	path = strdupa(path);
+	for (dir = strtok_r(path, ":", &p); dir; dir = strtok_r(NULL, ":", &p)) {
+		char *file;
+		int ret;
+
+		xasprintf(&file, "%s/%s", dir, tool);
+		ret = stat(file, &s);
+		free(file);
+		if (!ret && S_ISREG(s.st_mode)) {
+			hash_printf(ctx, "tool %lld %lld.%09ld", (long long)s.st_size,
+				    (long long)s.st_mtim.tv_sec, s.st_mtim.tv_nsec);
+			return;
+		}
+	}
+}
+
+static int filter_dots(const struct dirent *d)
+{
+	return strcmp(d->d_name, ".") && strcmp(d->d_name, "..");
+}
+
+static int name_sort(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * Hash the metadata of all files below @dirname. Like make, files are
+ * considered unchanged if their size and modification time are unchanged.
+ */
+static int hash_dir(struct image *image, struct sha256_ctx *ctx,
+		    const char *dirname, const char *rel)
+{
+	struct dirent **namelist;
+	int i, n, ret = 0;
+
+	n = scandir(dirname, &namelist, filter_dots, name_sort);
+	if (n < 0) {
+		ret = -errno;
+		image_error(image, "failed to scan '%s': %s\n", dirname, strerror(errno));
+		return ret;
+	}
+
+	for (i = 0; i < n; i++) {
+		char *path, *relpath;
+		struct stat s;
+
+		xasprintf(&path, "%s/%s", dirname, namelist[i]->d_name);
+		xasprintf(&relpath, "%s/%s", rel, namelist[i]->d_name);
+
+		if (!ret && lstat(path, &s)) {
+			ret = -errno;
+			image_error(image, "failed to stat '%s': %s\n", path, strerror(errno));
+		}
+		if (!ret) {
+			hash_printf(ctx, "%s %o %u %u %lld %lld.%09ld %llx", relpath,
+				    s.st_mode, s.st_uid, s.st_gid, (long long)s.st_size,
+				    (long long)s.st_mtim.tv_sec, s.st_mtim.tv_nsec,
+				    (unsigned long long)s.st_rdev);
+			if (S_ISLNK(s.st_mode)) {
+				char target[PATH_MAX];
+				ssize_t len = readlink(path, target, sizeof(target) - 1);
+
+				if (len >= 0) {
+					target[len] = '\0';
+					hash_printf(ctx, "-> %s", target);
+				}
+			} else if (S_ISDIR(s.st_mode)) {
+				ret = hash_dir(image, ctx, path, relpath);
+			}
+		}
+		free(path);
+		free(relpath);
+		free(namelist[i]);
+	}
+	free(namelist);
+
+	return ret;
+}
+
+static int hash_content(struct image *image, const char *filename,
+			struct sha256_ctx *ctx)
+{
+	char buf[65536];
+	ssize_t r;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		int ret = -errno;
+		image_error(image, "open %s: %s\n", filename, strerror(errno));
+		return ret;
+	}
+
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		sha256_update(ctx, buf, r);
+	if (r < 0) {
+		int ret = -errno;
+		image_error(image, "read %s: %s\n", filename, strerror(errno));
+		close(fd);
+		return ret;
+	}
+	close(fd);
+
+	return 0;
+}
+
+static int hash_file(struct image *image, const char *filename, char **hex)
+{
+	struct sha256_ctx ctx;
+	int ret;
+
+	sha256_init(&ctx);
+	ret = hash_content(image, filename, &ctx);
+	if (ret)
+		return ret;
+
+	*hex = hash_hex(&ctx);
+	return 0;
+}
+
+/*
+ * Handler options that name input files that are neither child images nor
+ * part of the rootpath. The content of these files is part of the key.
+ */
+static const struct {
+	const char *type;
+	const char *opt;
+} file_opts[] = {
+	{ "ext2", "mke2fs-conf" },
+	{ "ext2", "mke2fs_conf" },
+	{ "ext3", "mke2fs-conf" },
+	{ "ext3", "mke2fs_conf" },
+	{ "ext4", "mke2fs-conf" },
+	{ "ext4", "mke2fs_conf" },
+};
+
+static int is_cacheable(struct image *image)
+{
+	if (!cachedir())
+		return 0;
+	if (image->handler->no_cache || image->no_cache || !image->cfg)
+		return 0;
+	/* the commands may have arbitrary side effects */
+	if (image->exec_pre || image->exec_post)
+		return 0;
+	if (is_block_device(imageoutfile(image)))
+		return 0;
+	return 1;
+}
+
+static int cache_key(struct image *image)
+{
+	struct sha256_ctx ctx;
+	struct partition *part;
+	FILE *cfg;
+	char *buf = NULL;
+	size_t len = 0;
+	unsigned int i;
+	int ret;
+
+	sha256_init(&ctx);
+	hash_printf(&ctx, "genimage %s", PACKAGE_VERSION);
+	hash_printf(&ctx, "type %s", image->handler->type);
+	hash_printf(&ctx, "file %s", image->file);
+	hash_printf(&ctx, "size %llu", image->size);
+	/* used by several tools for reproducible timestamps */
+	hash_printf(&ctx, "epoch %s", getenv("SOURCE_DATE_EPOCH") ?: "");
+
+	cfg = open_memstream(&buf, &len);
+	if (!cfg) {
+		ret = -errno;
+		image_error(image, "open_memstream: %s\n", strerror(errno));
+		return ret;
+	}
+	cfg_print(image->cfg, cfg);
+	fclose(cfg);
+	sha256_update(&ctx, buf, len);
+	free(buf);
+
+	if (image->flash_type)
+		hash_printf(&ctx, "flash %d %d %d %d %d %d",
+			    image->flash_type->pebsize, image->flash_type->lebsize,
+			    image->flash_type->numpebs,
+			    image->flash_type->minimum_io_unit_size,
+			    image->flash_type->vid_header_offset,
+			    image->flash_type->sub_page_size);
+
+	for_each_opt(hash_opt, &ctx);
+
+	for (i = 0; i < ARRAY_SIZE(file_opts); i++) {
+		const char *file;
+
+		if (strcmp(image->handler->type, file_opts[i].type))
+			continue;
+		file = cfg_getstr(image->imagesec, file_opts[i].opt);
+		if (!file)
+			continue;
+		hash_printf(&ctx, "content %s", file_opts[i].opt);
+		ret = hash_content(image, file, &ctx);
+		if (ret)
+			return ret;
+	}
+
+	list_for_each_entry(part, &image->partitions, list) {
+		struct image *child;
+
+		if (!part->image)
+			continue;
+		child = image_get(part->image);
+		if (!child || !child->cache_key)
+			return -ENOENT;
+		hash_printf(&ctx, "child %s %s", child->file, child->cache_key);
+		if (child->sparse_input)
+			hash_printf(&ctx, "sparse-input %s", child->file);
+	}
+
+	if (!image->empty && !image->handler->no_rootpath) {
+		ret = hash_dir(image, &ctx, mountpath(image), "");
+		if (ret)
+			return ret;
+	}
+
+	image->cache_key = hash_hex(&ctx);
+
+	return 0;
+}
+
+/*
+ * Copy @src to @dst, with a reflink if possible. Never a hard link: the
+ * output may be truncated or written in place later, which must not change
+ * the cache entry.
+ */
+static int clone_file(const char *src, const char *dst)
+{
+	struct stat s;
+	int in, out, ret = 0;
+
+	in = open(src, O_RDONLY);
+	if (in < 0)
+		return -errno;
+	if (fstat(in, &s)) {
+		ret = -errno;
+		close(in);
+		return ret;
+	}
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		ret = -errno;
+		close(in);
+		return ret;
+	}
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0)
+		goto out;
+#endif
+	ret = copy_fd(in, out, s.st_size);
+out:
+	close(in);
+	if (out >= 0 && close(out) && !ret)
+		ret = -errno;
+	return ret;
+}
+
+/*
+ * Look up @image in the cache. Returns 1 if the image was restored from
+ * the cache, 0 if it needs to be generated.
+ */
+int cache_lookup(struct image *image)
+{
+	const char *outfile = imageoutfile(image);
+	unsigned long long size;
+	char *file, *info;
+	FILE *f;
+	int ret;
+
+	if (!is_cacheable(image))
+		return 0;
+
+	ret = cache_key(image);
+	if (ret == -ENOENT)
+		return 0;
+	if (ret)
+		return ret;
+
+	xasprintf(&file, "%s/%s", cachedir(), image->cache_key);
+	xasprintf(&info, "%s/%s.info", cachedir(), image->cache_key);
+
+	ret = 0;
+	f = fopen(info, "r");
+	if (f) {
+		if (fscanf(f, "size %llu", &size) == 1)
+			ret = 1;
+		fclose(f);
+	}
+
+	/*
+	 * Never modify an existing output in place: it may be a hard link
+	 * or reflink shared with another file.
+	 */
+	if (unlink(outfile) && errno != ENOENT) {
+		ret = -errno;
+		image_error(image, "failed to remove %s: %s\n", outfile, strerror(errno));
+		goto out;
+	}
+
+	if (ret) {
+		ret = clone_file(file, outfile);
+		if (ret) {
+			image_info(image, "failed to restore from cache: %s\n", strerror(-ret));
+			unlink(outfile);
+			ret = 0;
+			goto out;
+		}
+		image->size = size;
+		image_info(image, "restored from cache (%s)\n", image->cache_key);
+		ret = 1;
+	}
+out:
+	free(file);
+	free(info);
+	return ret;
+}
+
+/*
+ * Store the freshly generated @image in the cache. Images that cannot be
+ * cached get the hash of their content as key, so that images that use
+ * them can still be cached.
+ */
+int cache_store(struct image *image)
+{
+	char *file, *info, *tmp;
+	FILE *f;
+	int fd, ret;
+
+	if (!cachedir())
+		return 0;
+
+	if (!is_cacheable(image)) {
+		if (!image->n_dependents)
+			return 0;
+		return hash_file(image, imageoutfile(image), &image->cache_key);
+	}
+	if (!image->cache_key)
+		return 0;
+
+	xasprintf(&file, "%s/%s", cachedir(), image->cache_key);
+	xasprintf(&info, "%s/%s.info", cachedir(), image->cache_key);
+	xasprintf(&tmp, "%s/%s.XXXXXX", cachedir(), image->cache_key);
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		ret = -errno;
+		goto err_msg;
+	}
+	close(fd);
+
+	ret = clone_file(imageoutfile(image), tmp);
+	if (!ret && rename(tmp, file))
+		ret = -errno;
+	if (ret)
+		goto err;
+
+	/* the old name may already be reused by someone else */
+	free(tmp);
+	xasprintf(&tmp, "%s/%s.info.XXXXXX", cachedir(), image->cache_key);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		ret = -errno;
+		goto err_msg;
+	}
+	f = fdopen(fd, "w");
+	if (!f) {
+		ret = -errno;
+		close(fd);
+		goto err;
+	}
+	fprintf(f, "size %llu\n", image->size);
+	if (fclose(f)) {
+		ret = -errno;
+		goto err;
+	}
+	if (rename(tmp, info)) {
+		ret = -errno;
+		goto err;
+	}
+	goto out;
+err:
+	unlink(tmp);
+err_msg:
+	/* a failure to fill the cache does not fail the build */
+	image_info(image, "failed to store in cache: %s\n", strerror(-ret));
+	ret = 0;
+out:
+	free(file);
+	free(info);
+	free(tmp);
+	return ret;
+}
@@ -36,6 +36,7 @@ struct config {
 	char *value;
 	char *def;
 	int hidden;
+	int no_cache;
 };
 
 static void show_help(const char *cmd)
@@ -47,7 +48,8 @@ static void show_help(const char *cmd)
 	       "configuration file.\n\n"
 	       "Valid options:           [ default value ]    (environment variable)\n"
 	       "  -h, --help\n"
-	       "  -v, --version\n",
+	       "  -v, --version\n"
+	       "  -j <arg>               same as --jobs\n",
 	       cmd);
 	list_for_each_entry(c, &optlist, list) {
 		char opt[20], def[20];
@@ -98,6 +100,21 @@ static int set_opt(const char *name, const char *value)
 	return -EINVAL;
 }
 
+/*
+ * call @fn for each option that may affect the content of the
+ * generated images
+ */
+void for_each_opt(void (*fn)(const char *name, const char *value, void *data),
+		  void *data)
+{
+	struct config *c;
+
+	list_for_each_entry(c, &optlist, list) {
+		if (!c->no_cache)
+			fn(c->name, c->value, data);
+	}
+}
+
 const struct gpt_partition_type_shortcut_t *get_gpt_shortcuts(void)
 {
 	return config_gpt_shortcuts;
@@ -243,7 +260,7 @@ int set_config_opts(int argc, char *argv[], cfg_t *cfg)
 	while (1) {
 		int option_index = 0;
 
-		n = getopt_long(argc, argv, "hv",
+		n = getopt_long(argc, argv, "hvj:",
 				long_options, &option_index);
 		if (n == -1)
 			break;
@@ -253,6 +270,11 @@ int set_config_opts(int argc, char *argv[], cfg_t *cfg)
 			if (ret)
 				goto err_out;
 			break;
+		case 'j':
+			ret = set_opt("jobs", optarg);
+			if (ret)
+				goto err_out;
+			break;
 		case 'h':
 			show_help(argv[0]);
 			exit(0);
@@ -329,36 +351,69 @@ const char *tmppath(void)
 	return tmppath;
 }
 
+const char *cachedir(void)
+{
+	static const char *cachedir;
+	const char *dir;
+
+	if (!cachedir) {
+		dir = get_opt("cachedir");
+		if (dir && *dir)
+			cachedir = abspath(dir);
+	}
+
+	return cachedir;
+}
+
+const char *stagedir(void)
+{
+	static const char *stagedir;
+	const char *dir;
+
+	if (!stagedir) {
+		dir = get_opt("stagedir");
+		if (dir && *dir)
+			stagedir = abspath(dir);
+	}
+
+	return stagedir;
+}
+
 static struct config opts[] = {
 	{
 		.name = "loglevel",
 		.opt = CFG_STR("loglevel", NULL, CFGF_NONE),
 		.env = "GENIMAGE_LOGLEVEL",
 		.def = "1",
+		.no_cache = 1,
 	},
 	{
 		.name = "rootpath",
 		.opt = CFG_STR("rootpath", NULL, CFGF_NONE),
 		.env = "GENIMAGE_ROOTPATH",
 		.def = "root",
+		.no_cache = 1,
 	},
 	{
 		.name = "tmppath",
 		.opt = CFG_STR("tmppath", NULL, CFGF_NONE),
 		.env = "GENIMAGE_TMPPATH",
 		.def = "tmp",
+		.no_cache = 1,
 	},
 	{
 		.name = "inputpath",
 		.opt = CFG_STR("inputpath", NULL, CFGF_NONE),
 		.env = "GENIMAGE_INPUTPATH",
 		.def = "input",
+		.no_cache = 1,
 	},
 	{
 		.name = "outputpath",
 		.opt = CFG_STR("outputpath", NULL, CFGF_NONE),
 		.env = "GENIMAGE_OUTPUTPATH",
 		.def = "images",
+		.no_cache = 1,
 	},
 	{
 		.name = "includepath",
@@ -368,6 +423,90 @@ static struct config opts[] = {
 #ifndef HAVE_SEARCHPATH
 		.hidden = 1,
 #endif
+		.no_cache = 1,
+	},
+	{
+		.name = "cachedir",
+		.opt = CFG_STR("cachedir", NULL, CFGF_NONE),
+		.env = "GENIMAGE_CACHEDIR",
+		.def = NULL,
+		.no_cache = 1,
+	},
+	{
+		.name = "stage",
+		.opt = CFG_STR("stage", NULL, CFGF_NONE),
+		.env = "GENIMAGE_STAGE",
+		.def = "copy",
+		.no_cache = 1,
+	},
+	{
+		.name = "stagedir",
+		.opt = CFG_STR("stagedir", NULL, CFGF_NONE),
+		.env = "GENIMAGE_STAGEDIR",
+		.def = NULL,
+		.no_cache = 1,
+	},
+	{
+		.name = "stats",
+		.opt = CFG_STR("stats", NULL, CFGF_NONE),
+		.env = "GENIMAGE_STATS",
+		.def = NULL,
+		.no_cache = 1,
+	},
+	{
+		.name = "trace",
+		.opt = CFG_STR("trace", NULL, CFGF_NONE),
+		.env = "GENIMAGE_TRACE",
+		.def = NULL,
+		.no_cache = 1,
+	},
+	{
+		.name = "detect-zeros",
+		.opt = CFG_STR("detect-zeros", NULL, CFGF_NONE),
+		.env = "GENIMAGE_DETECT_ZEROS",
+		.def = "false",
+	},
+	{
+		.name = "sync",
+		.opt = CFG_STR("sync", NULL, CFGF_NONE),
+		.env = "GENIMAGE_SYNC",
+		.def = "always",
+		.no_cache = 1,
+	},
+	{
+		.name = "io-uring",
+		.opt = CFG_STR("io-uring", NULL, CFGF_NONE),
+		.env = "GENIMAGE_IO_URING",
+		.def = "auto",
+		.no_cache = 1,
+	},
+	{
+		.name = "crc32",
+		.opt = CFG_STR("crc32", NULL, CFGF_NONE),
+		.env = "GENIMAGE_CRC32",
+		.def = "auto",
+		.no_cache = 1,
+	},
+	{
+		.name = "streaming",
+		.opt = CFG_STR("streaming", NULL, CFGF_NONE),
+		.env = "GENIMAGE_STREAMING",
+		.def = "false",
+		.no_cache = 1,
+	},
+	{
+		.name = "skip-unchanged",
+		.opt = CFG_STR("skip-unchanged", NULL, CFGF_NONE),
+		.env = "GENIMAGE_SKIP_UNCHANGED",
+		.def = "false",
+		.no_cache = 1,
+	},
+	{
+		.name = "jobs",
+		.opt = CFG_STR("jobs", NULL, CFGF_NONE),
+		.env = "GENIMAGE_JOBS",
+		.def = "1",
+		.no_cache = 1,
 	},
 	{
 		.name = "cpio",
@@ -541,11 +680,13 @@ static struct config opts[] = {
 		.name = "config",
 		.env = "GENIMAGE_CONFIG",
 		.def = "genimage.cfg",
+		.no_cache = 1,
 	},
 	{
 		.name = "configdump",
 		.env = "GENIMAGE_CONFIGDUMP",
 		.def = NULL,
+		.no_cache = 1,
 	},
 };
 
@@ -1,7 +1,19 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
 #include "genimage.h"
 
+#ifdef HAVE_CRC32_PCLMUL
+#include <immintrin.h>
+#endif
+#ifdef HAVE_CRC32_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 static const uint32_t crc32_tab[] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
 	0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
@@ -48,18 +60,328 @@ static const uint32_t crc32_tab[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-uint32_t crc32_next(const void *data, size_t len, uint32_t last_crc)
+/* tables for slice-by-8, crc32_slice[0] is crc32_tab */
+static uint32_t crc32_slice[8][256];
+
+/*
+ * All engines work on the inverted CRC, crc32_next() takes care of
+ * the inversion.
+ */
+static uint32_t crc32_bytes(const void *data, size_t len, uint32_t crc)
 {
-	uint32_t crc = ~last_crc;
-	const char *p = data;
+	const unsigned char *p = data;
 
 	while (len--)
 		crc = crc32_tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
 
-	return ~crc;
+	return crc;
+}
+
+static uint32_t crc32_slice8(const void *data, size_t len, uint32_t crc)
+{
+	const unsigned char *p = data;
+	uint32_t one, two;
+
+	while (len >= 8) {
+		memcpy(&one, p, 4);
+		memcpy(&two, p + 4, 4);
+		one = le32toh(one) ^ crc;
+		two = le32toh(two);
+		crc = crc32_slice[7][one & 0xff] ^
+		      crc32_slice[6][(one >> 8) & 0xff] ^
+		      crc32_slice[5][(one >> 16) & 0xff] ^
+		      crc32_slice[4][one >> 24] ^
+		      crc32_slice[3][two & 0xff] ^
+		      crc32_slice[2][(two >> 8) & 0xff] ^
+		      crc32_slice[1][(two >> 16) & 0xff] ^
+		      crc32_slice[0][two >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	return crc32_bytes(p, len, crc);
+}
+
+#ifdef HAVE_CRC32_PCLMUL
+/*
+ * Fold 64 bytes at a time with carry-less multiplication and reduce the
+ * result with a Barrett reduction, as described in "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction" by Intel. The
+ * constants are for the bit-reflected polynomial 0xedb88320.
+ */
+__attribute__((target("pclmul")))
+static uint32_t crc32_pclmul_fold(const unsigned char *p, size_t len, uint32_t crc)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+	const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+	const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x0, x1, x2, x3, t0, t1, t2, t3;
+
+	x0 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+	p += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		t0 = _mm_clmulepi64_si128(x0, k1k2, 0x00);
+		t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		x0 = _mm_clmulepi64_si128(x0, k1k2, 0x11);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x0 = _mm_xor_si128(_mm_xor_si128(x0, t0),
+				   _mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+				   _mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, t2),
+				   _mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, t3),
+				   _mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		len -= 64;
+	}
+
+	/* fold the four lanes and the remaining 16 byte blocks into one */
+	t0 = _mm_clmulepi64_si128(x0, k3k4, 0x00);
+	x0 = _mm_clmulepi64_si128(x0, k3k4, 0x11);
+	x0 = _mm_xor_si128(_mm_xor_si128(x0, t0), x1);
+	t0 = _mm_clmulepi64_si128(x0, k3k4, 0x00);
+	x0 = _mm_clmulepi64_si128(x0, k3k4, 0x11);
+	x0 = _mm_xor_si128(_mm_xor_si128(x0, t0), x2);
+	t0 = _mm_clmulepi64_si128(x0, k3k4, 0x00);
+	x0 = _mm_clmulepi64_si128(x0, k3k4, 0x11);
+	x0 = _mm_xor_si128(_mm_xor_si128(x0, t0), x3);
+	while (len >= 16) {
+		t0 = _mm_clmulepi64_si128(x0, k3k4, 0x00);
+		x0 = _mm_clmulepi64_si128(x0, k3k4, 0x11);
+		x0 = _mm_xor_si128(_mm_xor_si128(x0, t0),
+				   _mm_loadu_si128((const __m128i *)p));
+		p += 16;
+		len -= 16;
+	}
+
+	/* 128 to 64 bits */
+	t0 = _mm_clmulepi64_si128(x0, k3k4, 0x10);
+	x0 = _mm_xor_si128(_mm_srli_si128(x0, 8), t0);
+	t0 = _mm_srli_si128(x0, 4);
+	x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask), k5, 0x00);
+	x0 = _mm_xor_si128(x0, t0);
+
+	/* Barrett reduction to 32 bits */
+	t0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask), poly, 0x10);
+	t0 = _mm_clmulepi64_si128(_mm_and_si128(t0, mask), poly, 0x00);
+	x0 = _mm_xor_si128(x0, t0);
+
+	return _mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
+}
+
+static uint32_t crc32_pclmul(const void *data, size_t len, uint32_t crc)
+{
+	const unsigned char *p = data;
+	size_t n = len & ~(size_t)15;
+
+	if (len < 64)
+		return crc32_slice8(p, len, crc);
+
+	crc = crc32_pclmul_fold(p, n, crc);
+
+	return crc32_slice8(p + n, len - n, crc);
+}
+
+static int crc32_pclmul_available(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul");
+}
+#endif
+
+#ifdef HAVE_CRC32_ARMV8
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(const void *data, size_t len, uint32_t crc)
+{
+	const unsigned char *p = data;
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		crc = __crc32d(crc, le64toh(v));
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = __crc32b(crc, *p++);
+
+	return crc;
+}
+
+static int crc32_armv8_available(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#endif
+
+struct crc32_engine {
+	const char *name;
+	uint32_t (*update)(const void *data, size_t len, uint32_t crc);
+	int (*available)(void);
+};
+
+/* sorted by preference, the table is the reference for the self-test */
+static const struct crc32_engine crc32_engines[] = {
+#ifdef HAVE_CRC32_PCLMUL
+	{ "pclmul", crc32_pclmul, crc32_pclmul_available },
+#endif
+#ifdef HAVE_CRC32_ARMV8
+	{ "armv8", crc32_armv8, crc32_armv8_available },
+#endif
+	{ "slice-by-8", crc32_slice8, NULL },
+	{ "table", crc32_bytes, NULL },
+};
+
+static const struct crc32_engine *crc32_engine =
+	&crc32_engines[ARRAY_SIZE(crc32_engines) - 1];
+
+/*
+ * Compare @engine with the table for all lengths up to 512 bytes at
+ * every alignment of a 16 byte vector.
+ */
+static int crc32_selftest(const struct crc32_engine *engine)
+{
+	unsigned char buf[512 + 16];
+	size_t len, align;
+	uint32_t crc;
+
+	for (len = 0; len < sizeof(buf); len++)
+		buf[len] = crc32_tab[len & 0xff] >> (len % 24);
+
+	for (align = 0; align < 16; align++) {
+		for (len = 0; len <= 512; len++) {
+			crc = crc32_bytes(buf + align, len, 0x12345678);
+			if (engine->update(buf + align, len, 0x12345678) != crc)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Select the CRC32 engine. With 'auto', the fastest engine that is
+ * supported by the CPU and passes the self-test is used. Otherwise,
+ * @name selects the engine.
+ */
+int crc32_init(const char *name)
+{
+	const struct crc32_engine *engine;
+	unsigned i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc32_slice[0][i] = crc32_tab[i];
+		for (j = 1; j < 8; j++)
+			crc32_slice[j][i] = (crc32_slice[j - 1][i] >> 8) ^
+					    crc32_tab[crc32_slice[j - 1][i] & 0xff];
+	}
+
+	if (!name || !*name)
+		name = "auto";
+
+	for (i = 0; i < ARRAY_SIZE(crc32_engines); i++) {
+		engine = &crc32_engines[i];
+		if (strcmp(name, "auto") && strcmp(name, engine->name))
+			continue;
+		if (engine->available && !engine->available()) {
+			if (strcmp(name, "auto")) {
+				error("crc32 engine '%s' is not supported by this CPU\n", name);
+				return -EINVAL;
+			}
+			continue;
+		}
+		if (crc32_selftest(engine)) {
+			error("crc32 engine '%s' failed the self-test\n", engine->name);
+			if (strcmp(name, "auto"))
+				return -EINVAL;
+			continue;
+		}
+		debug("using crc32 engine '%s'\n", engine->name);
+		crc32_engine = engine;
+		return 0;
+	}
+
+	error("invalid crc32 engine '%s'\n", name);
+	return -EINVAL;
+}
+
+uint32_t crc32_next(const void *data, size_t len, uint32_t last_crc)
+{
+	return ~crc32_engine->update(data, len, ~last_crc);
 }
 
 uint32_t crc32(const void *data, size_t len)
 {
 	return crc32_next(data, len, 0);
 }
+
+/* x^(2^n) modulo the CRC polynomial, bit-reflected */
+static const uint32_t crc32_x2n[32] = {
+	0x40000000, 0x20000000, 0x08000000, 0x00800000, 0x00008000, 0xedb88320,
+	0xb1e6b092, 0xa06a2517, 0xed627dae, 0x88d14467, 0xd7bbfe6a, 0xec447f11,
+	0x8e7ea170, 0x6427800e, 0x4d47bae0, 0x09fe548f, 0x83852d0f, 0x30362f1a,
+	0x7b5a9cc3, 0x31fec169, 0x9fec022a, 0x6c8dedc4, 0x15d6874d, 0x5fde7a4e,
+	0xbad90e37, 0x2e4e5eef, 0x4eaba214, 0xa8a472c0, 0x429a969e, 0x148d302a,
+	0xc40ba6d0, 0xc4e22c3c,
+};
+
+/* a * b modulo the CRC polynomial, bit-reflected */
+static uint32_t crc32_multmod(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	while (m) {
+		if (a & m)
+			p ^= b;
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+	}
+
+	return p;
+}
+
+/* x^(8 * len) modulo the CRC polynomial, bit-reflected */
+static uint32_t crc32_x8n(unsigned long long len)
+{
+	uint32_t p = 1U << 31;
+	unsigned k = 3;
+
+	for (; len; len >>= 1, k++) {
+		if (len & 1)
+			p = crc32_multmod(crc32_x2n[k & 31], p);
+	}
+
+	return p;
+}
+
+/*
+ * Continue @last_crc with @len zero bytes. Feeding zeros into the CRC
+ * register multiplies it by x^(8 * len), so this takes O(log(len)) steps
+ * instead of O(len).
+ */
+uint32_t crc32_zeros(uint32_t last_crc, unsigned long long len)
+{
+	return ~crc32_multmod(crc32_x8n(len), ~last_crc);
+}
+
+/*
+ * Return the CRC of A followed by B, given the CRC @crc1 of A and the CRC
+ * @crc2 of B, which is @len2 bytes long.
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, unsigned long long len2)
+{
+	return crc32_multmod(crc32_x8n(len2), crc1) ^ crc2;
+}
@@ -23,6 +23,9 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "genimage.h"
 
@@ -107,6 +110,7 @@ static cfg_opt_t partition_opts[] = {
 	CFG_BOOL("no-automount", cfg_false, CFGF_NONE),
 	CFG_BOOL("fill", cfg_false, CFGF_NONE),
 	CFG_BOOL("sparse", cfg_true, CFGF_NONE),
+	CFG_BOOL("detect-zeros", cfg_false, CFGF_NODEFAULT),
 	CFG_STR("image", NULL, CFGF_NONE),
 	CFG_STR_LIST("holes", NULL, CFGF_NONE),
 	CFG_STR("imageoffset", NULL, CFGF_NONE),
@@ -143,20 +147,79 @@ static cfg_opt_t flashchip_opts[] = {
 
 static LIST_HEAD(images);
 
+/*
+ * All images are also kept in a hash table indexed by their filename.
+ * The table is doubled whenever it gets full.
+ */
+static struct hlist_head *image_hash;
+static unsigned int image_hash_size;
+static unsigned int image_hash_count;
+
+static unsigned int image_hash_fn(const char *filename)
+{
+	unsigned int hash = 2166136261u;
+
+	/* FNV-1a */
+	while (*filename) {
+		hash ^= (unsigned char)*filename++;
+		hash *= 16777619u;
+	}
+
+	return hash & (image_hash_size - 1);
+}
+
+static void image_hash_add(struct image *image)
+{
+	hlist_add_head(&image->hash, &image_hash[image_hash_fn(image->file)]);
+}
+
+static void image_hash_grow(void)
+{
+	struct image *image;
+
+	free(image_hash);
+	image_hash_size = image_hash_size ? image_hash_size * 2 : 64;
+	image_hash = xzalloc(image_hash_size * sizeof(*image_hash));
+
+	list_for_each_entry(image, &images, list) {
+		if (!hlist_unhashed(&image->hash))
+			image_hash_add(image);
+	}
+}
+
 /*
  * find an image corresponding to a filename
  */
 struct image *image_get(const char *filename)
 {
+	struct hlist_node *pos;
 	struct image *image;
 
-	list_for_each_entry(image, &images, list) {
+	if (!image_hash)
+		return NULL;
+
+	hlist_for_each_entry(image, pos, &image_hash[image_hash_fn(filename)], hash) {
 		if (!strcmp(image->file, filename))
 			return image;
 	}
 	return NULL;
 }
 
+/*
+ * add an image to the list of images. If there are multiple images with
+ * the same filename, image_get() returns the first one.
+ */
+static void image_add(struct image *image)
+{
+	if (!image_get(image->file)) {
+		if (image_hash_count >= image_hash_size)
+			image_hash_grow();
+		image_hash_add(image);
+		image_hash_count++;
+	}
+	list_add_tail(&image->list, &images);
+}
+
 /*
  * setup the images. Calls ->setup function for each
  * image, recursively calls itself for resolving dependencies
@@ -195,9 +258,20 @@ static int image_setup(struct image *image)
 			image_error(image, "could not setup %s\n", child->file);
 			return ret;
 		}
+		/* only writer_insert_image() decodes sparse images */
+		if (child->sparse_input && !image->handler->sparse_input) {
+			image_error(image, "%s has 'sparse-input', which is not supported by %s images\n",
+				    child->file, image->handler->type);
+			return -EINVAL;
+		}
 	}
-	if (image->handler->setup)
+	if (image->handler->setup) {
+		unsigned long long start = trace_now();
+
 		ret = image->handler->setup(image, image->imagesec);
+		trace_span(start, "setup", image->file, "\"type\":\"%s\",\"ret\":%d",
+			   image->handler->type, ret);
+	}
 
 	if (ret)
 		return ret;
@@ -241,50 +315,143 @@ static int setenv_paths(void)
 	return 0;
 }
 
-static int setenv_image(const struct image *image)
+/*
+ * Build the environment for the commands run for @image: the environment
+ * of genimage itself with the image specific variables added. This is kept
+ * per image, so that multiple images can be generated concurrently.
+ */
+static void setenv_image(struct image *image)
 {
-	int ret;
 	char sizestr[20];
+	const char *vars[][2] = {
+		{ "IMAGE", image->file },
+		{ "IMAGEOUTFILE", imageoutfile(image) },
+		{ "IMAGENAME", image->name },
+		{ "IMAGESIZE", sizestr },
+		{ "IMAGEMOUNTPOINT", image->mountpoint },
+		{ "IMAGEMOUNTPATH", image->empty ? NULL : mountpath(image) },
+	};
+	unsigned int i, j, num = 0;
+	char **env;
 
 	snprintf(sizestr, sizeof(sizestr), "%llu", image->size);
 
-	ret = overwriteenv("IMAGE", image->file);
-	if (ret)
-		return ret;
+	while (environ[num])
+		num++;
 
-	ret = overwriteenv("IMAGEOUTFILE", imageoutfile(image));
-	if (ret)
-		return ret;
+	env = xzalloc((num + ARRAY_SIZE(vars) + 1) * sizeof(*env));
 
-	ret = overwriteenv("IMAGENAME", image->name);
-	if (ret)
+	num = 0;
+	for (i = 0; environ[i]; i++) {
+		for (j = 0; j < ARRAY_SIZE(vars); j++) {
+			size_t len = strlen(vars[j][0]);
+
+			if (!strncmp(environ[i], vars[j][0], len) &&
+			    environ[i][len] == '=')
+				break;
+		}
+		if (j == ARRAY_SIZE(vars))
+			env[num++] = environ[i];
+	}
+	for (j = 0; j < ARRAY_SIZE(vars); j++)
+		xasprintf(&env[num++], "%s=%s", vars[j][0], vars[j][1] ?: "");
+
+	image->env = env;
+}
+
+/*
+ * set an additional environment variable for the commands run for @image.
+ * Must be called from the generate function of the image.
+ */
+void image_setenv(struct image *image, const char *name, const char *value)
+{
+	size_t len = strlen(name);
+	unsigned int i;
+
+	for (i = 0; image->env[i]; i++) {
+		if (!strncmp(image->env[i], name, len) && image->env[i][len] == '=')
+			break;
+	}
+	if (!image->env[i]) {
+		image->env = xrealloc(image->env, (i + 2) * sizeof(*image->env));
+		image->env[i + 1] = NULL;
+	}
+	xasprintf(&image->env[i], "%s=%s", name, value);
+}
+
+/*
+ * generate a single image. Calls ->generate function for the
+ * image. All images it depends on must have been generated already.
+ */
+static int image_generate(struct image *image)
+{
+	int ret;
+
+	setenv_image(image);
+
+	ret = cache_lookup(image);
+	if (ret < 0)
 		return ret;
+	if (ret > 0) {
+		image->done = 1;
+		return sync_image(image);
+	}
 
-	ret = overwriteenv("IMAGESIZE", sizestr);
-	if (ret)
+	if (image->exec_pre) {
+		ret = systemp(image, "%s", image->exec_pre);
+		if (ret)
+			return ret;
+	}
+
+	if (image->handler->generate) {
+		ret = image->handler->generate(image);
+	} else {
+		image_error(image, "no generate function for %s\n", image->file);
+		return -EINVAL;
+	}
+
+	if (ret) {
+		struct stat s;
+		if (lstat(imageoutfile(image), &s) != 0 ||
+		    ((s.st_mode & S_IFMT) == S_IFREG) ||
+		    ((s.st_mode & S_IFMT) == S_IFLNK))
+			spawnl(image, "rm", "-f", imageoutfile(image), NULL);
 		return ret;
+	}
 
-	ret = overwriteenv("IMAGEMOUNTPOINT", image->mountpoint);
+	if (image->exec_post) {
+		ret = systemp(image, "%s", image->exec_post);
+		if (ret)
+			return ret;
+	}
+
+	ret = sync_image(image);
 	if (ret)
 		return ret;
 
-	ret = overwriteenv("IMAGEMOUNTPATH", image->empty ? NULL : mountpath(image));
+	ret = cache_store(image);
 	if (ret)
 		return ret;
 
+	image->done = 1;
+
 	return 0;
 }
 
+static struct image **generate_order;
+static unsigned int num_generate;
+
 /*
- * generate the images. Calls ->generate function for each
- * image, recursively calls itself for resolving dependencies
+ * sort the images into the order in which they are generated. Each
+ * image is added after all images it depends on, recursively calls
+ * itself for resolving dependencies.
  */
-static int image_generate(struct image *image)
+static int image_sort(struct image *image)
 {
 	int ret;
 	struct partition *part;
 
-	if (image->done > 0)
+	if (image->seen > 1)
 		return 0;
 
 	if (image->seen > 0) {
@@ -303,48 +470,254 @@ static int image_generate(struct image *image)
 			image_error(image, "could not find %s\n", part->image);
 			return -EINVAL;
 		}
-		ret = image_generate(child);
+		ret = image_sort(child);
 		if (ret) {
 			image_error(image, "could not generate %s\n", child->file);
 			return ret;
 		}
+		child->dependents = xrealloc(child->dependents,
+					     (child->n_dependents + 1) * sizeof(*child->dependents));
+		child->dependents[child->n_dependents++] = image;
+		image->n_pending++;
 	}
 
-	ret = setenv_image(image);
+	image->seen = 2;
+	generate_order[num_generate++] = image;
+
+	return 0;
+}
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int first;
+	unsigned int finished;
+	int ret;
+} generate_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Return the first image in generate_order that has all its dependencies
+ * generated and remove it from the list. With a single job this is always
+ * the first remaining image, so the images are generated in the same order
+ * as with a plain recursive walk.
+ */
+static struct image *image_get_ready(void)
+{
+	unsigned int i;
+
+	while (generate_state.first < num_generate &&
+	       !generate_order[generate_state.first])
+		generate_state.first++;
+
+	for (i = generate_state.first; i < num_generate; i++) {
+		struct image *image = generate_order[i];
+
+		if (image && !image->n_pending) {
+			generate_order[i] = NULL;
+			return image;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Worker for the image generation: Generate images as soon as all
+ * their dependencies are done until all images are generated or an
+ * error occurred.
+ */
+static void *generate_worker(void *arg)
+{
+	struct image *image;
+	unsigned long long start;
+	int i, ret;
+
+	pthread_mutex_lock(&generate_state.lock);
+	while (1) {
+		image = NULL;
+		while (!generate_state.ret && generate_state.finished < num_generate) {
+			image = image_get_ready();
+			if (image)
+				break;
+			pthread_cond_wait(&generate_state.cond, &generate_state.lock);
+		}
+		if (!image)
+			break;
+
+		pthread_mutex_unlock(&generate_state.lock);
+		start = trace_now();
+		ret = image_generate(image);
+		image->stats.generate_us = trace_now() - start;
+		trace_span(start, "generate", image->file, "\"type\":\"%s\",\"ret\":%d",
+			   image->handler->type, ret);
+		pthread_mutex_lock(&generate_state.lock);
+
+		generate_state.finished++;
+		if (ret) {
+			image_error(image, "failed to generate %s\n", image->file);
+			if (!generate_state.ret)
+				generate_state.ret = ret;
+		} else {
+			for (i = 0; i < image->n_dependents; i++)
+				image->dependents[i]->n_pending--;
+		}
+		pthread_cond_broadcast(&generate_state.cond);
+	}
+	pthread_mutex_unlock(&generate_state.lock);
+
+	return NULL;
+}
+
+unsigned int get_jobs(void)
+{
+	const char *str = get_opt("jobs");
+	long jobs = 1;
+	char *end;
+
+	if (str && *str) {
+		jobs = strtol(str, &end, 0);
+		if (*end || jobs < 0) {
+			error("invalid number of jobs '%s'\n", str);
+			exit(1);
+		}
+	}
+	if (jobs == 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return jobs > 0 ? jobs : 1;
+}
+
+static cfg_bool_t detect_zeros, streaming;
+static enum sync_mode sync_mode = SYNC_ALWAYS;
+static enum skip_unchanged skip_unchanged;
+
+static int parse_bool_opt(const char *name, cfg_bool_t *val)
+{
+	const char *str = get_opt(name);
+
+	if (!str || !*str || !strcmp(str, "false")) {
+		*val = cfg_false;
+		return 0;
+	}
+	if (!strcmp(str, "true")) {
+		*val = cfg_true;
+		return 0;
+	}
+
+	error("invalid value '%s' for %s\n", str, name);
+	return -EINVAL;
+}
+
+/*
+ * Parse the I/O options once at startup. They are used from the generate
+ * workers, where an invalid value could no longer be handled cleanly.
+ */
+static int parse_io_opts(void)
+{
+	const char *str;
+	int ret;
+
+	ret = parse_bool_opt("detect-zeros", &detect_zeros);
+	if (ret)
+		return ret;
+	ret = parse_bool_opt("streaming", &streaming);
 	if (ret)
 		return ret;
 
-	if (image->exec_pre) {
-		ret = systemp(image, "%s", image->exec_pre);
-		if (ret)
-			return ret;
+	str = get_opt("sync");
+	if (!str || !*str || !strcmp(str, "always")) {
+		sync_mode = SYNC_ALWAYS;
+	} else if (!strcmp(str, "final")) {
+		sync_mode = SYNC_FINAL;
+	} else if (!strcmp(str, "none")) {
+		sync_mode = SYNC_NONE;
+	} else {
+		error("invalid sync mode '%s'\n", str);
+		return -EINVAL;
 	}
 
-	if (image->handler->generate) {
-		ret = image->handler->generate(image);
+	str = get_opt("skip-unchanged");
+	if (!str || !*str || !strcmp(str, "false")) {
+		skip_unchanged = SKIP_UNCHANGED_NO;
+	} else if (!strcmp(str, "true")) {
+		skip_unchanged = SKIP_UNCHANGED_YES;
+	} else if (!strcmp(str, "verify")) {
+		skip_unchanged = SKIP_UNCHANGED_VERIFY;
 	} else {
-		image_error(image, "no generate function for %s\n", image->file);
+		error("invalid value '%s' for skip-unchanged\n", str);
 		return -EINVAL;
 	}
 
-	if (ret) {
-		struct stat s;
-		if (lstat(imageoutfile(image), &s) != 0 ||
-		    ((s.st_mode & S_IFMT) == S_IFREG) ||
-		    ((s.st_mode & S_IFMT) == S_IFLNK))
-			systemp(image, "rm -f \"%s\"", imageoutfile(image));
-		return ret;
-	}
+	return uring_init(get_opt("io-uring"));
+}
 
-	if (image->exec_post) {
-		ret = systemp(image, "%s", image->exec_post);
-		if (ret)
+cfg_bool_t get_detect_zeros(void)
+{
+	return detect_zeros;
+}
+
+cfg_bool_t get_streaming(void)
+{
+	return streaming;
+}
+
+enum sync_mode get_sync_mode(void)
+{
+	return sync_mode;
+}
+
+enum skip_unchanged get_skip_unchanged(void)
+{
+	return skip_unchanged;
+}
+
+/*
+ * generate all images. Independent images are generated concurrently by
+ * up to 'jobs' workers.
+ */
+static int generate_images(void)
+{
+	unsigned int jobs, num_threads = 0, i;
+	struct image *image;
+	pthread_t *threads;
+	int ret;
+
+	list_for_each_entry(image, &images, list)
+		num_generate++;
+
+	generate_order = xzalloc(num_generate * sizeof(*generate_order));
+	num_generate = 0;
+
+	list_for_each_entry(image, &images, list) {
+		ret = image_sort(image);
+		if (ret) {
+			image_error(image, "failed to generate %s\n", image->file);
 			return ret;
+		}
 	}
 
-	image->done = 1;
+	jobs = min(get_jobs(), num_generate);
+	threads = xzalloc(jobs * sizeof(*threads));
 
-	return 0;
+	/* the main thread is one of the workers */
+	for (i = 1; i < jobs; i++) {
+		ret = pthread_create(&threads[num_threads], NULL, generate_worker, NULL);
+		if (ret) {
+			error("failed to create worker thread: %s\n", strerror(ret));
+			break;
+		}
+		num_threads++;
+	}
+
+	generate_worker(NULL);
+
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	return generate_state.ret;
 }
 
 static LIST_HEAD(flashlist);
@@ -410,6 +783,10 @@ static int parse_partitions(struct image *image, cfg_t *imagesec)
 		part->no_automount = cfg_getbool(partsec, "no-automount");
 		part->fill = cfg_getbool(partsec, "fill");
 		part->sparse = cfg_getbool(partsec, "sparse");
+		if (cfg_size(partsec, "detect-zeros") > 0)
+			part->detect_zeros = cfg_getbool(partsec, "detect-zeros");
+		else
+			part->detect_zeros = get_detect_zeros();
 		part->image = cfg_getstr(partsec, "image");
 		part->imageoffset = cfg_getint_suffix(partsec, "imageoffset");
 		part->autoresize = cfg_getbool(partsec, "autoresize");
@@ -479,6 +856,15 @@ char *sanitize_path(const char *path)
 	return path_sanitized;
 }
 
+/*
+ * The rootpath is staged in the tmppath unless a persistent stagedir is
+ * used.
+ */
+static const char *stagepath(void)
+{
+	return stagedir() ?: tmppath();
+}
+
 static struct mountpoint *add_mountpoint(const char *path)
 {
 	struct mountpoint *mp;
@@ -491,7 +877,7 @@ static struct mountpoint *add_mountpoint(const char *path)
 	path_sanitized = sanitize_path(path);
 	mp = xzalloc(sizeof(*mp));
 	mp->path = strdup(path);
-	xasprintf(&mp->mountpath, "%s/mp-%s", tmppath(), path_sanitized);
+	xasprintf(&mp->mountpath, "%s/mp-%s", stagepath(), path_sanitized);
 	list_add_tail(&mp->list, &mountpoints);
 	free(path_sanitized);
 
@@ -504,15 +890,104 @@ static void add_root_mountpoint(void)
 
 	mp = xzalloc(sizeof(*mp));
 	mp->path = strdup("");
-	xasprintf(&mp->mountpath, "%s/root", tmppath());
+	xasprintf(&mp->mountpath, "%s/root", stagepath());
 	list_add_tail(&mp->list, &mountpoints);
 }
 
+/* marks a stagedir as created by genimage */
+#define STAGEDIR_MARKER ".genimage-stagedir"
+
+/*
+ * Make sure that the stagedir belongs to genimage before anything in it is
+ * modified: it must contain the marker file or be empty, in which case the
+ * marker is created.
+ */
+static int claim_stagedir(void)
+{
+	struct dirent *d;
+	char *marker;
+	int fd, ret = 0, empty = 1;
+	DIR *dir;
+
+	xasprintf(&marker, "%s/%s", stagedir(), STAGEDIR_MARKER);
+	if (!access(marker, F_OK))
+		goto out;
+
+	dir = opendir(stagedir());
+	if (!dir) {
+		ret = -errno;
+		error("opendir %s: %s\n", stagedir(), strerror(errno));
+		goto out;
+	}
+	while ((d = readdir(dir))) {
+		if (strcmp(d->d_name, ".") && strcmp(d->d_name, ".."))
+			empty = 0;
+	}
+	closedir(dir);
+	if (!empty) {
+		error("stagedir %s is not empty and was not created by genimage\n",
+		      stagedir());
+		ret = -EINVAL;
+		goto out;
+	}
+
+	fd = open(marker, O_WRONLY | O_CREAT, 0666);
+	if (fd < 0) {
+		ret = -errno;
+		error("open %s: %s\n", marker, strerror(errno));
+		goto out;
+	}
+	close(fd);
+out:
+	free(marker);
+	return ret;
+}
+
+/*
+ * remove the trees of mountpoints from previous runs that are no longer
+ * used. Only the entries that genimage creates are considered.
+ */
+static int prune_stagedir(void)
+{
+	struct mountpoint *mp;
+	struct dirent *d;
+	DIR *dir;
+	int ret = 0;
+
+	dir = opendir(stagedir());
+	if (!dir) {
+		ret = -errno;
+		error("opendir %s: %s\n", stagedir(), strerror(errno));
+		return ret;
+	}
+
+	while (!ret && (d = readdir(dir))) {
+		char *path;
+		int used = 0;
+
+		if (strcmp(d->d_name, "root") && strncmp(d->d_name, "mp-", 3))
+			continue;
+
+		xasprintf(&path, "%s/%s", stagedir(), d->d_name);
+		list_for_each_entry(mp, &mountpoints, list) {
+			if (!strcmp(mp->mountpath, path))
+				used = 1;
+		}
+		if (!used) {
+			debug("removing stale staging directory %s\n", path);
+			ret = remove_tree(path);
+		}
+		free(path);
+	}
+	closedir(dir);
+
+	return ret;
+}
+
 static int collect_mountpoints(void)
 {
 	struct image *image;
-	struct mountpoint *mp;
-	int ret, need_mtime_fixup = 0, need_root = 0;
+	int ret, need_root = 0;
 
 	list_for_each_entry(image, &images, list) {
 		if (!(image->empty || image->handler->no_rootpath || image->srcpath)) {
@@ -527,11 +1002,7 @@ static int collect_mountpoints(void)
 
 	add_root_mountpoint();
 
-	ret = systemp(NULL, "mkdir -p \"%s\"", tmppath());
-	if (ret)
-		return ret;
-
-	ret = systemp(NULL, "cp -a \"%s\" \"%s/root\"", rootpath(), tmppath());
+	ret = spawnl(NULL, "mkdir", "-p", stagepath(), NULL);
 	if (ret)
 		return ret;
 
@@ -540,34 +1011,17 @@ static int collect_mountpoints(void)
 			image->mp = add_mountpoint(image->mountpoint);
 	}
 
-	list_for_each_entry(mp, &mountpoints, list) {
-		if (!strlen(mp->path))
-			continue;
-		ret = systemp(NULL, "mv \"%s/root/%s\" \"%s\"", tmppath(), mp->path, mp->mountpath);
-		if (ret)
-			return ret;
-		ret = systemp(NULL, "mkdir \"%s/root/%s\"", tmppath(), mp->path);
-		if (ret)
-			return ret;
-		ret = systemp(NULL, "chmod --reference=\"%s\" \"%s/root/%s\"", mp->mountpath, tmppath(), mp->path);
+	if (stagedir()) {
+		ret = claim_stagedir();
 		if (ret)
 			return ret;
-		ret = systemp(NULL, "chown --reference=\"%s\" \"%s/root/%s\"", mp->mountpath, tmppath(), mp->path);
+		ret = prune_stagedir();
 		if (ret)
 			return ret;
-		need_mtime_fixup = 1;
 	}
 
-	/*
-	 * After the mv/mkdir of the mountpoints the timestamps of the
-	 * mountpoint and all parent dirs are changed. Fix that here.
-	 */
-	if (need_mtime_fixup)
-		ret = systemp(NULL,
-			      "find '%s/root' -depth -type d -printf '%%P\\0' | xargs -0 -I {} touch -r '%s/{}' '%s/root/{}'",
-			      tmppath(), rootpath(), tmppath());
-
-	return ret;
+	return stage_rootpath(rootpath(), get_mountpoint("")->mountpath,
+			      &mountpoints, get_jobs(), stagedir() != NULL);
 }
 
 const char *mountpath(const struct image *image)
@@ -607,7 +1061,7 @@ static void check_tmp_path(void)
 
 	dir = opendir(tmp);
 	if (!dir) {
-		ret = systemp(NULL, "mkdir -p \"%s\"", tmppath());
+		ret = spawnl(NULL, "mkdir", "-p", tmppath(), NULL);
 		if (ret)
 			exit(1);
 		tmppath_generated = TMPPATH_CREATED;
@@ -631,7 +1085,7 @@ static void cleanup(void)
 {
 	switch (tmppath_generated) {
 	case TMPPATH_CREATED:
-		systemp(NULL, "rm -rf \"%s/\"", tmppath());
+		spawnl(NULL, "rm", "-rf", tmppath(), NULL);
 		break;
 	case TMPPATH_CHECKED:
 		systemp(NULL, "rm -rf \"%s\"/*", tmppath());
@@ -691,6 +1145,7 @@ int main(int argc, char *argv[])
 					ARRAY_SIZE(handlers) + 1) *
 				       sizeof(cfg_opt_t));
 	int start;
+	unsigned long long span_start;
 	struct image *image;
 	const char *str;
 	cfg_t *cfg;
@@ -740,6 +1195,11 @@ int main(int argc, char *argv[])
 #endif
 	}
 
+	ret = trace_init(get_opt("trace"));
+	if (ret)
+		goto cleanup;
+
+	span_start = trace_now();
 	ret = cfg_parse(cfg, get_opt("config"));
 	switch (ret) {
 	case 0:
@@ -754,6 +1214,19 @@ int main(int argc, char *argv[])
 	/* again, with config file this time */
 	set_config_opts(argc, argv, cfg);
 
+	ret = trace_init(get_opt("trace"));
+	if (ret)
+		goto cleanup;
+	trace_span(span_start, "config", get_opt("config"), NULL);
+
+	ret = crc32_init(get_opt("crc32"));
+	if (ret)
+		goto cleanup;
+
+	ret = parse_io_opts();
+	if (ret)
+		goto cleanup;
+
 	str = get_opt("randomseed");
 	if (!str || (*str == '\0')) {
 		random32_init();
@@ -790,7 +1263,7 @@ int main(int argc, char *argv[])
 		cfg_t *imagesec = cfg_getnsec(cfg, "image", i);
 		image = xzalloc(sizeof *image);
 		INIT_LIST_HEAD(&image->partitions);
-		list_add_tail(&image->list, &images);
+		image->cfg = imagesec;
 		image->file = cfg_title(imagesec);
 		image->name = cfg_getstr(imagesec, "name");
 		image->size = cfg_getint_suffix_percent(imagesec, "size",
@@ -801,6 +1274,7 @@ int main(int argc, char *argv[])
 		image->temporary = cfg_getbool(imagesec, "temporary");
 		image->exec_pre = cfg_getstr(imagesec, "exec-pre");
 		image->exec_post = cfg_getstr(imagesec, "exec-post");
+		image_add(image);
 		if (image->file[0] == '/')
 			image->outfile = strdup(image->file);
 		else
@@ -854,8 +1328,8 @@ int main(int argc, char *argv[])
 			image_debug(image, "adding implicit file rule for '%s'\n", part->image);
 			child = xzalloc(sizeof *image);
 			INIT_LIST_HEAD(&child->partitions);
-			list_add_tail(&child->list, &images);
 			child->file = part->image;
+			image_add(child);
 			child->handler = &file_handler;
 			if (child->handler->parse) {
 				ret = child->handler->parse(child, child->imagesec);
@@ -871,7 +1345,9 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto cleanup;
 
+	span_start = trace_now();
 	ret = collect_mountpoints();
+	trace_span(span_start, "stage", "collect_mountpoints", NULL);
 	if (ret)
 		goto cleanup;
 
@@ -885,19 +1361,23 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto cleanup;
 
-	ret = systemp(NULL, "mkdir -p \"%s\"", imagepath());
+	ret = spawnl(NULL, "mkdir", "-p", imagepath(), NULL);
 	if (ret)
 		goto cleanup;
 
-	list_for_each_entry(image, &images, list) {
-		ret = image_generate(image);
-		if (ret) {
-			image_error(image, "failed to generate %s\n", image->file);
+	if (cachedir()) {
+		ret = spawnl(NULL, "mkdir", "-p", cachedir(), NULL);
+		if (ret)
 			goto cleanup;
-		}
 	}
 
+	ret = generate_images();
+
+	if (stats_write(&images) && !ret)
+		ret = -EIO;
+
 cleanup:
 	cleanup();
+	trace_close();
 	return ret ? 1 : 0;
 }
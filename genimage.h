@@ -10,6 +10,9 @@ struct image_handler;
 struct image *image_get(const char *filename);
 
 int systemp(struct image *image, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int spawnv(struct image *image, char *const argv[], char **out, char **err);
+int spawnl(struct image *image, const char *arg, ...) __attribute__((sentinel));
+void image_setenv(struct image *image, const char *name, const char *value);
 void error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void info(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void debug(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
@@ -29,6 +32,8 @@ const char *imagepath(void);
 const char *inputpath(void);
 const char *rootpath(void);
 const char *tmppath(void);
+const char *cachedir(void);
+const char *stagedir(void);
 const char *mountpath(const struct image *);
 struct flash_type;
 
@@ -36,6 +41,8 @@ struct mountpoint {
 	char *path;
 	struct list_head list;
 	char *mountpath;
+	/* found in the rootpath by stage_rootpath() */
+	int staged;
 };
 
 struct partition {
@@ -51,6 +58,7 @@ struct partition {
 	cfg_bool_t no_automount;
 	cfg_bool_t fill;
 	cfg_bool_t sparse;
+	cfg_bool_t detect_zeros;
 	const char *image;
 	unsigned long long imageoffset;
 	struct list_head list;
@@ -62,6 +70,35 @@ struct partition {
 	cfg_t *cfg;
 };
 
+/* I/O done by genimage itself */
+struct io_stats {
+	unsigned long long read;
+	unsigned long long written;
+	/* data shared with the input file by a reflink */
+	unsigned long long cloned;
+	/* zeros that were not written because the output is sparse */
+	unsigned long long skipped;
+	unsigned long long punched;
+	/* blocks of a block device that already contained the data */
+	unsigned long long unchanged;
+	unsigned long long writes;
+	unsigned long long fsyncs;
+	unsigned long long fsync_us;
+};
+
+/* resource usage of the commands run for an image */
+struct image_stats {
+	unsigned int cmds;
+	unsigned long long generate_us;
+	unsigned long long cmd_wall_us;
+	unsigned long long utime_us;
+	unsigned long long stime_us;
+	unsigned long long maxrss_kb;
+	unsigned long long inblock;
+	unsigned long long oublock;
+	struct io_stats io;
+};
+
 struct image {
 	const char *name;
 	const char *file;
@@ -79,6 +116,7 @@ struct image {
 	void *handler_priv;
 	struct image_handler *handler;
 	struct list_head list;
+	struct hlist_node hash;
 	int done;
 	struct flash_type *flash_type;
 	cfg_t *imagesec;
@@ -87,11 +125,22 @@ struct image {
 	char *outfile;
 	int seen;
 	off_t last_offset;
+	char **env;
+	struct image **dependents;
+	int n_dependents;
+	int n_pending;
+	cfg_t *cfg;
+	char *cache_key;
+	cfg_bool_t no_cache;
+	cfg_bool_t sparse_input;
+	struct image_stats stats;
 };
 
 struct image_handler {
 	char *type;
 	cfg_bool_t no_rootpath;
+	cfg_bool_t no_cache;
+	cfg_bool_t sparse_input;
 	int (*parse)(struct image *i, cfg_t *cfg);
 	int (*setup)(struct image *i, cfg_t *cfg);
 	int (*generate)(struct image *i);
@@ -169,6 +218,8 @@ cfg_opt_t *get_confuse_opts(void);
 const char *get_opt(const char *name);
 const struct gpt_partition_type_shortcut_t *get_gpt_shortcuts(void);
 int set_config_opts(int argc, char *argv[], cfg_t *cfg);
+void for_each_opt(void (*fn)(const char *name, const char *value, void *data),
+		  void *data);
 
 static inline size_t min(size_t a, size_t b)
 {
@@ -185,10 +236,25 @@ struct extent {
 };
 
 int open_file(struct image *image, const char *filename, int extra_flags);
-int whole_file_exent(size_t size, struct extent **extents,
-		     size_t *extent_count);
-int map_file_extents(struct image *image, const char *filename, int fd,
-		     size_t size, struct extent **extents, size_t *extent_count);
+/* iterates over the data extents of a file */
+struct extent_iter {
+	struct image *image;
+	const char *filename;
+	int fd;
+	int mode;
+	/* everything before pos was returned */
+	unsigned long long pos, size;
+	/* current FIEMAP batch */
+	struct fiemap *fiemap;
+	unsigned idx;
+	int mapped, last, fallback;
+};
+void extent_iter_init(struct extent_iter *it, struct image *image,
+		      const char *filename, int fd,
+		      unsigned long long start, unsigned long long size);
+void extent_iter_init_whole(struct extent_iter *it, unsigned long long size);
+int extent_iter_next(struct extent_iter *it, struct extent *ext);
+void extent_iter_free(struct extent_iter *it);
 int is_block_device(const char *filename);
 int block_device_size(struct image *image, const char *blkdev,
 		      unsigned long long *size);
@@ -199,6 +265,66 @@ int insert_image(struct image *image, struct image *sub,
 		 unsigned char byte, cfg_bool_t sparse);
 int insert_data(struct image *image, const void *data, const char *outfile,
 		size_t size, unsigned long long offset);
+
+struct image_writer;
+int writer_open(struct image *image, struct image_writer **writer);
+int writer_insert_image(struct image_writer *w, struct image *sub,
+			unsigned long long size, unsigned long long offset,
+			unsigned long long imageoffset,
+			unsigned char byte, cfg_bool_t sparse,
+			cfg_bool_t detect_zeros);
+int writer_insert_data(struct image_writer *w, const void *data, size_t size,
+		       unsigned long long offset);
+int writer_extend(struct image_writer *w, unsigned long long size);
+int writer_close(struct image_writer *w);
+
+/* limits the page cache used by large sequential reads or writes */
+struct stream {
+	/* -1 if streaming is disabled */
+	int fd;
+	int output;
+	/* range that was read or written since the last flush */
+	unsigned long long start, end;
+	/* range of the output that is being written back */
+	unsigned long long wb_start, wb_end;
+};
+void stream_open(struct stream *s, int fd, int output);
+void stream_seek(struct stream *s, unsigned long long pos);
+void stream_advance(struct stream *s, unsigned long long pos);
+void stream_close(struct stream *s);
+
+/* the android sparse image format */
+#define SPARSE_MAGIC 0xed26ff3a
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t header_size;
+	uint16_t chunk_header_size;
+	uint32_t block_size;
+	uint32_t output_blocks;
+	uint32_t input_chunks;
+	uint32_t crc32;
+} __attribute__((packed));
+
+#define SPARSE_RAW	 htole16(0xCAC1)
+#define SPARSE_FILL	 htole16(0xCAC2)
+#define SPARSE_DONT_CARE htole16(0xCAC3)
+#define SPARSE_CRC32	 htole16(0xCAC4)
+
+struct sparse_chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved;
+	uint32_t blocks;
+	uint32_t size;
+} __attribute__((packed));
+
+int sparse_image_size(struct image *image, const char *filename,
+		      unsigned long long *size);
+
+int copy_fd(int in, int out, off_t size);
+int sync_image(struct image *image);
 int extend_file(struct image *image, size_t size);
 int reload_partitions(struct image *image);
 int parse_holes(struct image *image, cfg_t *cfg);
@@ -220,8 +346,70 @@ char *uuid_random(void);
 
 unsigned long long image_dir_size(struct image *image);
 
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count;
+	unsigned char buf[64];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_SIZE]);
+
+unsigned long long trace_now(void);
+int trace_enabled(void);
+int trace_init(const char *filename);
+void trace_close(void);
+char *json_string(const char *str);
+void trace_span(unsigned long long start, const char *cat, const char *name,
+		const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+struct rusage;
+void stats_add_cmd(struct image *image, const struct rusage *ru,
+		   unsigned long long wall_us);
+void stats_add_io(struct image *image, const struct io_stats *io);
+int stats_write(struct list_head *images);
+
+struct uring;
+int uring_init(const char *mode);
+struct uring *uring_open(void);
+void uring_close(struct uring *ring);
+long long uring_copy(struct uring *ring, int in, int out,
+		     unsigned long long in_pos, unsigned long long offset,
+		     unsigned long long len, struct io_stats *io);
+int uring_fill(struct uring *ring, int fd, unsigned long long offset,
+	       unsigned long long len, unsigned char byte, struct io_stats *io);
+
+int cache_lookup(struct image *image);
+int cache_store(struct image *image);
+
+unsigned int get_jobs(void);
+cfg_bool_t get_detect_zeros(void);
+cfg_bool_t get_streaming(void);
+
+enum sync_mode {
+	SYNC_NONE,
+	SYNC_FINAL,
+	SYNC_ALWAYS,
+};
+enum sync_mode get_sync_mode(void);
+enum skip_unchanged {
+	SKIP_UNCHANGED_NO,
+	SKIP_UNCHANGED_YES,
+	SKIP_UNCHANGED_VERIFY,
+};
+enum skip_unchanged get_skip_unchanged(void);
+int stage_rootpath(const char *src, const char *dst, struct list_head *mountpoints,
+		   unsigned int jobs, int sync);
+int remove_tree(const char *path);
+
+int crc32_init(const char *name);
 uint32_t crc32(const void *data, size_t len);
 uint32_t crc32_next(const void *data, size_t len, uint32_t last_crc);
+uint32_t crc32_zeros(uint32_t last_crc, unsigned long long len);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, unsigned long long len2);
 
 #define ct_assert(e) _Static_assert(e, #e)
 
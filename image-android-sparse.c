@@ -18,6 +18,7 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -30,32 +31,9 @@ struct sparse {
 	uint32_t block_size;
 	cfg_bool_t fill_holes;
 	cfg_bool_t add_crc;
+	unsigned long long max_size;
 };
 
-struct sparse_header {
-	uint32_t magic;
-	uint16_t major_version;
-	uint16_t minor_version;
-	uint16_t header_size;
-	uint16_t chunk_header_size;
-	uint32_t block_size;
-	uint32_t output_blocks;
-	uint32_t input_chunks;
-	uint32_t crc32;
-} __attribute__((packed));
-
-#define SPARSE_RAW	 htole16(0xCAC1)
-#define SPARSE_FILL	 htole16(0xCAC2)
-#define SPARSE_DONT_CARE htole16(0xCAC3)
-#define SPARSE_CRC32	 htole16(0xCAC4)
-
-struct sparse_chunk_header {
-	uint16_t chunk_type;
-	uint16_t reserved;
-	uint32_t blocks;
-	uint32_t size;
-} __attribute__((packed));
-
 static int write_data(struct image *image, int fd, const void *data, size_t size)
 {
 	int ret = 0;
@@ -72,65 +50,639 @@ static int write_data(struct image *image, int fd, const void *data, size_t size
 	return ret;
 }
 
-static int flush_header(struct image *image, int fd, struct sparse_chunk_header *header,
-			ssize_t offset)
+/* size of the output buffer */
+#define SPARSE_OUT_BUF (1024 * 1024)
+
+/*
+ * The sparse output. Small writes are collected in a buffer. With max-size,
+ * the output is split into pieces. Each piece is a valid sparse image of the
+ * whole input, with "don't care" chunks for the blocks of the other pieces.
+ */
+struct sparse_out {
+	struct image *image;
+	struct sparse *sparse;
+	struct sparse_header header;
+	int fd;
+	char *buf;
+	size_t len;
+	/* output offset of buf[0] */
+	unsigned long long offset;
+	/* the chunk that is currently written and the offset of its header */
+	struct sparse_chunk_header chunk;
+	unsigned long long chunk_pos;
+	uint32_t fill_value;
+	uint32_t max_raw_blocks;
+	uint32_t input_chunks;
+	/* the next input block to be written */
+	uint32_t block;
+	/* CRC of the blocks before the current window */
+	uint32_t crc;
+	/* the data of the current window that is not part of 'crc' yet */
+	const char *crc_pos;
+	int crc_split;
+	unsigned int piece;
+	struct stream stream;
+};
+
+static int out_flush(struct sparse_out *out)
 {
 	int ret;
 
+	if (!out->len)
+		return 0;
+	ret = write_data(out->image, out->fd, out->buf, out->len);
+	if (ret < 0)
+		return ret;
+	out->offset += out->len;
+	out->len = 0;
+	stream_advance(&out->stream, out->offset);
+
+	return 0;
+}
+
+static int out_write(struct sparse_out *out, const void *data, size_t size)
+{
+	int ret;
+
+	if (out->len + size > SPARSE_OUT_BUF) {
+		ret = out_flush(out);
+		if (ret < 0)
+			return ret;
+	}
+	if (size >= SPARSE_OUT_BUF) {
+		ret = write_data(out->image, out->fd, data, size);
+		if (ret < 0)
+			return ret;
+		out->offset += size;
+		stream_advance(&out->stream, out->offset);
+		return 0;
+	}
+	memcpy(out->buf + out->len, data, size);
+	out->len += size;
+
+	return 0;
+}
+
+/*
+ * Write the final header of the current chunk. It is usually still in the
+ * buffer, otherwise it is written to its place in the file.
+ */
+static int chunk_close(struct sparse_out *out)
+{
+	struct sparse_chunk_header *header = &out->chunk;
+
 	if (header->chunk_type == 0)
 		return 0;
 
-	if (offset >= 0) {
-		if (lseek(fd, offset, SEEK_SET) < 0) {
-			ret = -errno;
-			image_error(image, "seek %s: %s\n", imageoutfile(image),
-				    strerror(errno));
+	if (out->chunk_pos >= out->offset) {
+		memcpy(out->buf + (out->chunk_pos - out->offset), header, sizeof(*header));
+	} else if (pwrite(out->fd, header, sizeof(*header), out->chunk_pos) != sizeof(*header)) {
+		int ret = errno ? -errno : -EIO;
+
+		image_error(out->image, "write %s: %s\n", imageoutfile(out->image),
+			    strerror(-ret));
+		return ret;
+	}
+	if (header->blocks > 0 || header->chunk_type == SPARSE_CRC32)
+		image_debug(out->image, "chunk(0x%04x): blocks =%7u size =%10u bytes\n",
+			    header->chunk_type, header->blocks, header->size);
+	header->chunk_type = 0;
+
+	return 0;
+}
+
+static int chunk_open(struct sparse_out *out, uint16_t chunk_type, uint32_t size)
+{
+	int ret;
+
+	ret = chunk_close(out);
+	if (ret < 0)
+		return ret;
+
+	out->input_chunks++;
+	out->chunk_pos = out->offset + out->len;
+	out->chunk.chunk_type = chunk_type;
+	out->chunk.blocks = 0;
+	out->chunk.size = size;
+
+	return out_write(out, &out->chunk, sizeof(out->chunk));
+}
+
+static int chunk_dont_care(struct sparse_out *out, uint32_t blocks)
+{
+	int ret;
+
+	ret = chunk_open(out, SPARSE_DONT_CARE, sizeof(struct sparse_chunk_header));
+	if (ret < 0)
+		return ret;
+	out->chunk.blocks = blocks;
+	if (out->sparse->add_crc)
+		out->crc = crc32_zeros(out->crc, blocks *
+				       (unsigned long long)out->sparse->block_size);
+
+	return chunk_close(out);
+}
+
+/* space needed to finish a piece: the trailing "don't care" and CRC chunks */
+static unsigned long long piece_trailer(struct sparse *sparse)
+{
+	unsigned long long size = sizeof(struct sparse_chunk_header);
+
+	if (sparse->add_crc)
+		size += sizeof(struct sparse_chunk_header) + sizeof(uint32_t);
+	return size;
+}
+
+/* check if @size more bytes fit into the current piece */
+static int piece_fits(struct sparse_out *out, unsigned long long size)
+{
+	return !out->sparse->max_size ||
+	       out->offset + out->len + size + piece_trailer(out->sparse) <=
+		       out->sparse->max_size;
+}
+
+static char *piece_name(struct image *image, unsigned int piece)
+{
+	char *name;
+
+	xasprintf(&name, "%s.%u", imageoutfile(image), piece);
+	return name;
+}
+
+/*
+ * Start a new piece. The blocks that were written to the previous pieces
+ * are skipped with a "don't care" chunk.
+ */
+static int piece_open(struct sparse_out *out)
+{
+	char *name = NULL;
+	int ret;
+
+	if (out->sparse->max_size)
+		name = piece_name(out->image, out->piece);
+	out->fd = open_file(out->image, name ? name : imageoutfile(out->image), O_TRUNC);
+	free(name);
+	if (out->fd < 0)
+		return out->fd;
+	stream_open(&out->stream, out->fd, 1);
+
+	out->offset = 0;
+	out->len = 0;
+	out->input_chunks = 0;
+	out->crc = 0;
+
+	ret = out_write(out, &out->header, sizeof(out->header));
+	if (ret < 0)
+		return ret;
+	if (out->block > 0)
+		return chunk_dont_care(out, out->block);
+
+	return 0;
+}
+
+/*
+ * Finish the current piece. The remaining blocks are "don't care". @pos is
+ * the data of the current window that is written next and that is not part
+ * of this piece anymore.
+ */
+static int piece_close(struct sparse_out *out, const char *pos)
+{
+	struct sparse_header *header = &out->header;
+	uint32_t block = out->block;
+	int buffered, ret;
+
+	if (out->sparse->add_crc && out->crc_pos && pos) {
+		out->crc = crc32_next(out->crc_pos, pos - out->crc_pos, out->crc);
+		out->crc_pos = pos;
+		out->crc_split = 1;
+	}
+
+	ret = chunk_close(out);
+	if (ret < 0)
+		return ret;
+
+	if (block < header->output_blocks) {
+		ret = chunk_dont_care(out, header->output_blocks - block);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (out->sparse->add_crc) {
+		/*
+		 * Albeit CRC is supported by the sparse format, the Android
+		 * tools don't honor the support and now starting to fail if an
+		 * CRC is found.
+		 */
+		ret = chunk_open(out, SPARSE_CRC32,
+				 sizeof(struct sparse_chunk_header) + sizeof(out->crc));
+		if (ret < 0)
+			return ret;
+		ret = out_write(out, &out->crc, sizeof(out->crc));
+		if (ret < 0)
+			return ret;
+		ret = chunk_close(out);
+		if (ret < 0)
 			return ret;
-		}
 	}
 
-	ret = write_data(image, fd, header, sizeof(*header));
+	/* the header is still in the buffer for small images */
+	header->input_chunks = out->input_chunks;
+	buffered = out->offset == 0;
+	if (buffered)
+		memcpy(out->buf, header, sizeof(*header));
+	ret = out_flush(out);
 	if (ret < 0)
 		return ret;
+	if (!buffered && pwrite(out->fd, header, sizeof(*header), 0) != sizeof(*header)) {
+		ret = errno ? -errno : -EIO;
+		image_error(out->image, "write %s: %s\n", imageoutfile(out->image),
+			    strerror(-ret));
+		return ret;
+	}
+
+	if (out->sparse->max_size)
+		image_info(out->image, "sparse image piece %u with %u chunks and %u blocks\n",
+			   out->piece, header->input_chunks, header->output_blocks);
+	else
+		image_info(out->image, "sparse image with %u chunks and %u blocks\n",
+			   header->input_chunks, header->output_blocks);
+
+	/* --sync=final only syncs the output file, which does not exist */
+	if (out->sparse->max_size && get_sync_mode() != SYNC_NONE && fdatasync(out->fd)) {
+		ret = -errno;
+		image_error(out->image, "fdatasync() failed: %s\n", strerror(errno));
+		return ret;
+	}
+
+	stream_close(&out->stream);
+	close(out->fd);
+	out->fd = -1;
+	out->piece++;
+
+	return 0;
+}
+
+/*
+ * Make sure that a new chunk with @size bytes fits into the current piece.
+ * Otherwise the piece is finished and the next one is started.
+ */
+static int piece_reserve(struct sparse_out *out, unsigned long long size, const char *pos)
+{
+	int ret;
+
+	if (out->fd >= 0 && piece_fits(out, size))
+		return 0;
+	if (out->fd >= 0) {
+		ret = piece_close(out, pos);
+		if (ret < 0)
+			return ret;
+	}
+	return piece_open(out);
+}
+
+/* skip @blocks blocks of the input that are not mapped */
+static int emit_dont_care(struct sparse_out *out, uint32_t blocks)
+{
+	int ret = 0;
+
+	/* a new piece starts with a "don't care" chunk for these blocks */
+	if (out->fd < 0)
+		goto out;
+
+	if (!piece_fits(out, sizeof(struct sparse_chunk_header)))
+		ret = piece_close(out, NULL);
+	else
+		ret = chunk_dont_care(out, blocks);
+out:
+	out->block += blocks;
+	return ret;
+}
+
+static int emit_fill(struct sparse_out *out, uint32_t value, uint32_t blocks,
+		     const char *pos)
+{
+	int ret;
+
+	if (out->chunk.chunk_type != SPARSE_FILL || out->fill_value != value) {
+		ret = piece_reserve(out, sizeof(struct sparse_chunk_header) + sizeof(value),
+				    pos);
+		if (ret < 0)
+			return ret;
+		ret = chunk_open(out, SPARSE_FILL,
+				 sizeof(struct sparse_chunk_header) + sizeof(value));
+		if (ret < 0)
+			return ret;
+		out->fill_value = value;
+		ret = out_write(out, &value, sizeof(value));
+		if (ret < 0)
+			return ret;
+	}
+	out->chunk.blocks += blocks;
+	out->block += blocks;
 
-	if (offset >= 0) {
-		if (lseek(fd, 0, SEEK_END) < 0) {
-			ret = -errno;
-			image_error(image, "seek %s: %s\n", imageoutfile(image),
-				    strerror(errno));
+	return 0;
+}
+
+static int emit_raw(struct sparse_out *out, const char *data, uint32_t blocks)
+{
+	uint32_t block_size = out->sparse->block_size;
+	unsigned long long room;
+	uint32_t now;
+	int ret;
+
+	while (blocks > 0) {
+		if (out->chunk.chunk_type != SPARSE_RAW ||
+		    out->chunk.blocks >= out->max_raw_blocks ||
+		    !piece_fits(out, block_size)) {
+			ret = piece_reserve(out, sizeof(struct sparse_chunk_header) + block_size,
+					    data);
+			if (ret < 0)
+				return ret;
+			ret = chunk_open(out, SPARSE_RAW, sizeof(struct sparse_chunk_header));
+			if (ret < 0)
+				return ret;
+		}
+		now = min(blocks, out->max_raw_blocks - out->chunk.blocks);
+		if (out->sparse->max_size) {
+			room = (out->sparse->max_size - piece_trailer(out->sparse) -
+				out->offset - out->len) / block_size;
+			now = min(now, room);
+		}
+		ret = out_write(out, data, (size_t)now * block_size);
+		if (ret < 0)
 			return ret;
+		out->chunk.blocks += now;
+		out->chunk.size += now * block_size;
+		out->block += now;
+		data += (size_t)now * block_size;
+		blocks -= now;
+	}
+
+	return 0;
+}
+
+/* amount of input that is read and classified by a worker at once */
+#define SPARSE_WINDOW (2 * 1024 * 1024)
+
+/* a run of raw blocks or of fill blocks with the same value */
+struct sparse_run {
+	uint32_t blocks;
+	uint32_t fill;
+	uint32_t value;
+};
+
+enum window_state {
+	WINDOW_FREE,
+	WINDOW_QUEUED,
+	WINDOW_DONE,
+};
+
+/* a part of an extent of the input */
+struct sparse_window {
+	enum window_state state;
+	/* first window of an extent */
+	int first;
+	unsigned long long offset;
+	size_t len;
+	char *buf;
+	struct sparse_run *runs;
+	unsigned num_runs;
+	uint32_t crc;
+	int ret;
+};
+
+/* the windows in flight, shared with the workers */
+struct sparse_queue {
+	struct image *image;
+	struct sparse *sparse;
+	const char *infile;
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct sparse_window *windows;
+	unsigned num_windows;
+	/* next window to fill, to classify and to write */
+	unsigned long long tail, claim, head;
+	int stop;
+};
+
+/*
+ * Read the window and split it into runs of raw and fill blocks. A block
+ * is a fill block if all its 32 bit words are equal, which is the case if
+ * it is equal to itself shifted by 4 bytes. This lets memcmp() do the
+ * comparison with vector instructions.
+ */
+static void window_process(struct sparse_queue *q, struct sparse_window *w)
+{
+	uint32_t block_size = q->sparse->block_size;
+	size_t done = 0, blocks, i;
+	struct sparse_run *run = NULL;
+	ssize_t r;
+
+	while (done < w->len) {
+		r = pread(q->fd, w->buf + done, w->len - done, w->offset + done);
+		if (r < 0) {
+			w->ret = -errno;
+			image_error(q->image, "read %s: %s\n", q->infile, strerror(errno));
+			return;
+		}
+		if (r == 0) {
+			w->ret = -EINVAL;
+			image_error(q->image, "short read %s %lld != %lld\n", q->infile,
+				    (long long)done, (long long)w->len);
+			return;
 		}
+		done += r;
 	}
-	if (header->blocks > 0 || header->chunk_type == SPARSE_CRC32)
-		image_debug(image, "chunk(0x%04x): blocks =%7u size =%10u bytes\n",
-			    header->chunk_type, header->blocks, header->size);
+
+	/* The sparse format only allows image sizes that are a multiple of
+	   the block size. Pad the last block as needed. */
+	blocks = (w->len + block_size - 1) / block_size;
+	memset(w->buf + w->len, 0, blocks * block_size - w->len);
+	w->len = blocks * block_size;
+
+	if (q->sparse->add_crc)
+		w->crc = crc32(w->buf, w->len);
+
+	w->num_runs = 0;
+	for (i = 0; i < blocks; i++) {
+		const char *b = w->buf + i * block_size;
+		uint32_t value, fill;
+
+		memcpy(&value, b, sizeof(value));
+		fill = !memcmp(b, b + sizeof(value), block_size - sizeof(value));
+		if (!run || run->fill != fill || (fill && run->value != value)) {
+			run = &w->runs[w->num_runs++];
+			run->blocks = 0;
+			run->fill = fill;
+			run->value = value;
+		}
+		run->blocks++;
+	}
+	w->ret = 0;
+}
+
+static void *sparse_worker(void *data)
+{
+	struct sparse_queue *q = data;
+	struct sparse_window *w;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (!q->stop && q->claim == q->tail)
+			pthread_cond_wait(&q->cond, &q->lock);
+		if (q->stop)
+			break;
+		w = &q->windows[q->claim++ % q->num_windows];
+		pthread_mutex_unlock(&q->lock);
+
+		window_process(q, w);
+
+		pthread_mutex_lock(&q->lock);
+		w->state = WINDOW_DONE;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+/*
+ * Write the runs of @w. Raw blocks are written directly from the window.
+ * The CRC of the window is only recalculated if a new piece was started in
+ * the middle of it.
+ */
+static int window_write(struct sparse_out *out, struct sparse_window *w)
+{
+	uint32_t block_size = out->sparse->block_size;
+	const char *data = w->buf;
+	unsigned i;
+	int ret;
+
+	out->crc_pos = w->buf;
+	out->crc_split = 0;
+	for (i = 0; i < w->num_runs; i++) {
+		const struct sparse_run *run = &w->runs[i];
+
+		if (run->fill)
+			ret = emit_fill(out, run->value, run->blocks, data);
+		else
+			ret = emit_raw(out, data, run->blocks);
+		if (ret < 0)
+			return ret;
+		data += (size_t)run->blocks * block_size;
+	}
+	if (out->sparse->add_crc) {
+		if (out->crc_split)
+			out->crc = crc32_next(out->crc_pos, data - out->crc_pos, out->crc);
+		else
+			out->crc = crc32_combine(out->crc, w->crc, w->len);
+	}
+	out->crc_pos = NULL;
 
 	return 0;
 }
 
+/*
+ * Get the next extent of the input. The extents may have a different
+ * granularity than the chosen block size. So the start and end of each
+ * extent are aligned accordingly. The extents may overlap now, so they
+ * are merged if necessary. @next holds the extent that was read ahead.
+ */
+static int next_extent(struct sparse *sparse, struct extent_iter *it,
+		       unsigned long long size, struct extent *next,
+		       int *have_next, struct extent *ext)
+{
+	struct extent e;
+	int ret;
+
+	if (!*have_next) {
+		ret = extent_iter_next(it, next);
+		if (ret <= 0)
+			return ret;
+	}
+	*have_next = 0;
+	*ext = *next;
+	ext->start = ext->start / sparse->block_size * sparse->block_size;
+	ext->end = (ext->end - 1 + sparse->block_size) / sparse->block_size *
+		   sparse->block_size;
+	ext->end = min(ext->end, size);
+
+	while ((ret = extent_iter_next(it, &e)) > 0) {
+		if (e.start / sparse->block_size * sparse->block_size > ext->end) {
+			*next = e;
+			*have_next = 1;
+			return 1;
+		}
+		e.end = (e.end - 1 + sparse->block_size) / sparse->block_size *
+			sparse->block_size;
+		ext->end = min(e.end, size);
+	}
+
+	return ret < 0 ? ret : 1;
+}
+
+/*
+ * Remove the pieces from earlier runs, starting with @piece, and the output
+ * file that is not written with max-size.
+ */
+static int remove_stale_pieces(struct image *image, unsigned int piece)
+{
+	const char *outfile = imageoutfile(image);
+	char *name;
+	int ret;
+
+	if (!is_block_device(outfile) && unlink(outfile) && errno != ENOENT) {
+		ret = -errno;
+		image_error(image, "failed to remove %s: %s\n", outfile, strerror(errno));
+		return ret;
+	}
+	for (;; piece++) {
+		name = piece_name(image, piece);
+		if (unlink(name)) {
+			ret = errno == ENOENT ? 0 : -errno;
+			if (ret)
+				image_error(image, "failed to remove %s: %s\n", name,
+					    strerror(errno));
+			free(name);
+			return ret;
+		}
+		free(name);
+	}
+}
+
+/*
+ * The input is split into windows that are read and classified by up to
+ * 'jobs' workers. The windows are written in order by the calling thread,
+ * so the output is the same for any number of workers.
+ */
 static int android_sparse_generate(struct image *image)
 {
 	struct sparse *sparse = image->handler_priv;
 	struct image *inimage;
 	const char *infile;
-	struct sparse_header header;
-	struct sparse_chunk_header chunk_header = {};
-	struct extent *extents = NULL;
-	size_t extent_count, extent, block_count, block;
-	int in_fd = -1, out_fd = -1, ret;
-	off_t offset;
-	unsigned int i;
-	uint32_t *buf, *zeros, crc32 = 0;
-	uint32_t max_raw_blocks = (UINT32_MAX - sizeof(struct sparse_chunk_header)) / sparse->block_size;
+	struct sparse_queue q = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct sparse_out out = { .fd = -1, .stream = { .fd = -1 } };
+	struct sparse_window *w;
+	struct extent_iter it = {};
+	struct extent ext = {}, next;
+	unsigned long long ext_pos = 0;
+	int in_fd = -1, have_next = 0, more = 1, ret;
+	struct stream in_stream;
+	size_t window_size;
+	pthread_t *threads = NULL;
+	unsigned int jobs, num_threads = 0, i;
 	struct stat s;
 
-	memset(&header, 0, sizeof(header));
-	header.magic = htole32(0xed26ff3a);
-	header.major_version = htole16(0x1);
-	header.minor_version = htole16(0x0);
-	header.header_size = htole16(sizeof(struct sparse_header));
-	header.chunk_header_size = htole16(sizeof(struct sparse_chunk_header));
-	header.block_size = sparse->block_size;
+	out.header.magic = htole32(SPARSE_MAGIC);
+	out.header.major_version = htole16(0x1);
+	out.header.minor_version = htole16(0x0);
+	out.header.header_size = htole16(sizeof(struct sparse_header));
+	out.header.chunk_header_size = htole16(sizeof(struct sparse_chunk_header));
+	out.header.block_size = sparse->block_size;
 
 	inimage = image_get(list_first_entry(&image->partitions, struct partition, list)->image);
 	infile = imageoutfile(inimage);
@@ -141,228 +693,170 @@ static int android_sparse_generate(struct image *image)
 		image_error(image, "open %s: %s\n", infile, strerror(errno));
 		return ret;
 	}
+	stream_open(&in_stream, in_fd, 0);
 	ret = fstat(in_fd, &s);
 	if (ret) {
 		ret = -errno;
 		image_error(image, "stat %s: %s\n", infile, strerror(errno));
 		goto out;
 	}
-	block_count = (s.st_size - 1 + sparse->block_size) / sparse->block_size;
-	header.output_blocks = block_count;
+	out.header.output_blocks = (s.st_size - 1 + sparse->block_size) / sparse->block_size;
 
 	if (sparse->fill_holes)
-		whole_file_exent(s.st_size, &extents, &extent_count);
-	else {
-		ret = map_file_extents(inimage, infile, in_fd, s.st_size, &extents, &extent_count);
+		extent_iter_init_whole(&it, s.st_size);
+	else
+		extent_iter_init(&it, inimage, infile, in_fd, 0, s.st_size);
+
+	out.image = image;
+	out.sparse = sparse;
+	out.max_raw_blocks = (UINT32_MAX - sizeof(struct sparse_chunk_header)) /
+			     sparse->block_size;
+	out.buf = xzalloc(SPARSE_OUT_BUF);
+
+	/* the pieces are only created once there is data for them */
+	if (!sparse->max_size) {
+		ret = piece_open(&out);
 		if (ret < 0)
 			goto out;
 	}
 
-	/* The extents may have a different granularity than the chosen block size.
-	   So all start and end of all extents must be aligned accordingly. The
-	   extents may overlap now, so merge them if necessary. */
-	for (extent = 0; extent < extent_count; ++extent) {
-		int j;
-
-		extents[extent].start = extents[extent].start / sparse->block_size *
-					sparse->block_size;
-		extents[extent].end = (extents[extent].end - 1 + sparse->block_size) /
-				      sparse->block_size * sparse->block_size;
-		extents[extent].end = min(extents[extent].end, s.st_size);
-
-		for (j = extent - 1; j > 0; --j)
-			if (extents[j].end != 0)
-				break;
-
-		if (j >= 0 && extents[extent].start <= extents[j].end) {
-			extents[j].end = extents[extent].end;
-			extents[extent].start = 0;
-			extents[extent].end = 0;
-		}
+	jobs = get_jobs();
+	window_size = SPARSE_WINDOW / sparse->block_size * sparse->block_size;
+	if (!window_size)
+		window_size = sparse->block_size;
+	q.image = image;
+	q.sparse = sparse;
+	q.infile = infile;
+	q.fd = in_fd;
+	q.num_windows = 2 * jobs;
+	q.windows = xzalloc(q.num_windows * sizeof(*q.windows));
+	for (i = 0; i < q.num_windows; i++) {
+		q.windows[i].buf = xzalloc(window_size);
+		q.windows[i].runs = xzalloc(window_size / sparse->block_size *
+					    sizeof(struct sparse_run));
 	}
 
-	out_fd = open_file(image, imageoutfile(image), O_TRUNC);
-	if (out_fd < 0) {
-		ret = out_fd;
-		goto out;
+	/* with a single job, the windows are processed by this thread */
+	threads = xzalloc(jobs * sizeof(*threads));
+	for (i = 1; i < jobs; i++) {
+		ret = pthread_create(&threads[num_threads], NULL, sparse_worker, &q);
+		if (ret) {
+			image_error(image, "failed to create worker thread: %s\n",
+				    strerror(ret));
+			break;
+		}
+		num_threads++;
 	}
-
-	ret = write_data(image, out_fd, &header, sizeof(header));
-	if (ret < 0)
-		goto out;
-
-	block = 0;
-	buf = xzalloc(sparse->block_size);
-	zeros = xzalloc(sparse->block_size);
-	memset(zeros, 0, sparse->block_size);
-	for (extent = 0; extent < extent_count; ++extent) {
-		uint32_t start_block = extents[extent].start / sparse->block_size;
-		size_t size = extents[extent].end - extents[extent].start;
-		uint32_t fill_value = 0;
-		size_t pos;
-
-		/* skip removed extents */
-		if (size == 0)
-			continue;
-
-		if (block < start_block) {
-			header.input_chunks++;
-			chunk_header.chunk_type = SPARSE_DONT_CARE;
-			chunk_header.blocks = start_block - block;
-			chunk_header.size = sizeof(chunk_header);
-			ret = flush_header(image, out_fd, &chunk_header, -1);
-			if (ret < 0)
-				return ret;
-			block = start_block;
-
-			for (i = 0; i < chunk_header.blocks; ++i)
-				crc32 = crc32_next(zeros, sparse->block_size, crc32);
+	ext.end = 0;
+
+	for (;;) {
+		/* queue windows until all are in flight */
+		pthread_mutex_lock(&q.lock);
+		while (more && q.tail - q.head < q.num_windows) {
+			if (ext_pos >= ext.end) {
+				pthread_mutex_unlock(&q.lock);
+				ret = next_extent(sparse, &it, s.st_size, &next, &have_next, &ext);
+				pthread_mutex_lock(&q.lock);
+				if (ret < 0)
+					goto out_unlock;
+				if (!ret) {
+					more = 0;
+					break;
+				}
+				ext_pos = ext.start;
+			}
+			w = &q.windows[q.tail % q.num_windows];
+			w->first = ext_pos == ext.start;
+			w->offset = ext_pos;
+			w->len = min(ext.end - ext_pos, window_size);
+			w->state = WINDOW_QUEUED;
+			ext_pos += w->len;
+			q.tail++;
 		}
-		offset = lseek(in_fd, extents[extent].start, SEEK_SET);
-		if (offset < 0) {
-			ret = -errno;
-			image_error(image, "seek %s: %s\n", infile, strerror(errno));
-			goto out;
+		if (q.head == q.tail) {
+			pthread_mutex_unlock(&q.lock);
+			break;
 		}
-		chunk_header.chunk_type = 0;
-		chunk_header.blocks = 0;
-		pos = lseek(out_fd, 0, SEEK_CUR);
-
-		while (size > 0) {
-			ssize_t now = min(size, sparse->block_size);
-			int fill = 1;
-			ssize_t r = read(in_fd, buf, now);
-
-			if (r < 0) {
-				ret = -errno;
-				image_error(image, "read %s: %s\n", infile, strerror(errno));
-				goto out;
-			} else if (r != now) {
-				ret = -EINVAL;
-				image_error(image, "short read %s %lld != %lld\n", infile,
-					    (long long)r, (long long)now);
-				goto out;
-			}
-
-			/* The sparse format only allows image sizes that are a multiple of
-			   the block size. Pad the last block as needed. */
-			if ((uint32_t)r < sparse->block_size) {
-				memset(((char *)buf) + r, 0, sparse->block_size - r);
-				now = sparse->block_size;
-			}
+		pthread_cond_broadcast(&q.cond);
+		w = &q.windows[q.head % q.num_windows];
+		if (!num_threads && w->state == WINDOW_QUEUED) {
+			q.claim++;
+			pthread_mutex_unlock(&q.lock);
+			window_process(&q, w);
+			pthread_mutex_lock(&q.lock);
+			w->state = WINDOW_DONE;
+		}
+		while (w->state != WINDOW_DONE)
+			pthread_cond_wait(&q.cond, &q.lock);
+		pthread_mutex_unlock(&q.lock);
 
-			crc32 = crc32_next(buf, sparse->block_size, crc32);
+		ret = w->ret;
+		if (ret < 0)
+			goto out;
 
-			for (i = 1; i < sparse->block_size / 4; ++i) {
-				if (buf[0] != buf[i]) {
-					fill = 0;
-					break;
-				}
-			}
-			if (fill) {
-				if (chunk_header.chunk_type != SPARSE_FILL ||
-				    fill_value != buf[0]) {
-					header.input_chunks++;
-					ret = flush_header(image, out_fd, &chunk_header, pos);
-					if (ret < 0)
-						return ret;
-
-					pos = lseek(out_fd, 0, SEEK_CUR);
-					chunk_header.chunk_type = SPARSE_FILL;
-					chunk_header.size = sizeof(chunk_header) + sizeof(buf[0]);
-					chunk_header.blocks = 0;
-					fill_value = buf[0];
-
-					ret = flush_header(image, out_fd, &chunk_header, -1);
-					if (ret < 0)
-						return ret;
-					ret = write_data(image, out_fd, buf, sizeof(buf[0]));
-					if (ret < 0)
-						goto out;
-				}
-				chunk_header.blocks++;
-			} else {
-				if (chunk_header.chunk_type != SPARSE_RAW ||
-				    chunk_header.blocks >= max_raw_blocks) {
-					header.input_chunks++;
-					ret = flush_header(image, out_fd, &chunk_header, pos);
-					if (ret < 0)
-						return ret;
-
-					pos = lseek(out_fd, 0, SEEK_CUR);
-					chunk_header.chunk_type = SPARSE_RAW;
-					chunk_header.size = sizeof(chunk_header);
-					chunk_header.blocks = 0;
-					ret = flush_header(image, out_fd, &chunk_header, -1);
-					if (ret < 0)
-						return ret;
-				}
-				chunk_header.blocks++;
-				chunk_header.size += now;
+		if (w->first) {
+			uint32_t start_block = w->offset / sparse->block_size;
 
-				ret = write_data(image, out_fd, buf, now);
+			ret = chunk_close(&out);
+			if (ret < 0)
+				goto out;
+			if (out.block < start_block) {
+				ret = emit_dont_care(&out, start_block - out.block);
 				if (ret < 0)
 					goto out;
 			}
-
-			size -= r;
+			stream_seek(&in_stream, w->offset);
 		}
-		ret = flush_header(image, out_fd, &chunk_header, pos);
+		ret = window_write(&out, w);
 		if (ret < 0)
-			return ret;
-		block = (extents[extent].end - 1 + sparse->block_size) / sparse->block_size;
-	}
-
-	if (block < block_count) {
-		header.input_chunks++;
-		chunk_header.chunk_type = SPARSE_DONT_CARE;
-		chunk_header.blocks = block_count - block;
-		chunk_header.size = sizeof(chunk_header);
-		ret = flush_header(image, out_fd, &chunk_header, -1);
-		if (ret < 0)
-			return ret;
+			goto out;
+		stream_advance(&in_stream, w->offset + w->len);
 
-		for (i = 0; i < chunk_header.blocks; ++i)
-			crc32 = crc32_next(zeros, sparse->block_size, crc32);
+		pthread_mutex_lock(&q.lock);
+		w->state = WINDOW_FREE;
+		q.head++;
+		pthread_mutex_unlock(&q.lock);
 	}
 
-	if (sparse->add_crc) {
-		/*
-		 * Albeit CRC is supported by the sparse format, the Android
-		 * tools don't honor the support and now starting to fail if an
-		 * CRC is found.
-		 */
-		header.input_chunks++;
-		chunk_header.chunk_type = SPARSE_CRC32;
-		chunk_header.blocks = 0;
-		chunk_header.size = sizeof(chunk_header) + sizeof(crc32);
-		ret = flush_header(image, out_fd, &chunk_header, -1);
+	/* finish the last piece, an input without data still needs one */
+	if (out.fd < 0 && out.piece == 0) {
+		ret = piece_open(&out);
 		if (ret < 0)
-			return ret;
-		ret = write_data(image, out_fd, &crc32, sizeof(crc32));
+			goto out;
+	}
+	if (out.fd >= 0) {
+		ret = piece_close(&out, NULL);
 		if (ret < 0)
 			goto out;
 	}
+	if (sparse->max_size)
+		ret = remove_stale_pieces(image, out.piece);
+	goto out;
 
-	offset = lseek(out_fd, 0, SEEK_SET);
-	if (offset < 0) {
-		ret = -errno;
-		image_error(image, "seek %s: %s\n", infile, strerror(errno));
-		goto out;
+out_unlock:
+	pthread_mutex_unlock(&q.lock);
+out:
+	pthread_mutex_lock(&q.lock);
+	q.stop = 1;
+	pthread_cond_broadcast(&q.cond);
+	pthread_mutex_unlock(&q.lock);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	for (i = 0; i < q.num_windows; i++) {
+		free(q.windows[i].buf);
+		free(q.windows[i].runs);
 	}
-	ret = write_data(image, out_fd, &header, sizeof(header));
-	if (ret < 0)
-		goto out;
+	free(q.windows);
 
-	image_info(image, "sparse image with %u chunks and %u blocks\n",
-		   header.input_chunks, header.output_blocks);
-
-out:
+	stream_close(&in_stream);
 	close(in_fd);
-	if (out_fd >= 0)
-		close(out_fd);
-	if (extents)
-		free(extents);
+	if (out.fd >= 0) {
+		stream_close(&out.stream);
+		close(out.fd);
+	}
+	free(out.buf);
+	extent_iter_free(&it);
 	return ret;
 }
 
@@ -388,6 +882,7 @@ static int android_sparse_parse(struct image *image, cfg_t *cfg)
 static int android_sparse_setup(struct image *image, cfg_t *cfg)
 {
 	struct sparse *sparse = xzalloc(sizeof(*sparse));
+	unsigned long long min_size;
 
 	sparse->block_size = cfg_getint_suffix(cfg, "block-size");
 	if (sparse->block_size % 512) {
@@ -399,6 +894,19 @@ static int android_sparse_setup(struct image *image, cfg_t *cfg)
 
 	sparse->add_crc = cfg_getbool(cfg, "add-crc");
 
+	/* a piece needs room for at least one block of data */
+	sparse->max_size = cfg_getint_suffix(cfg, "max-size");
+	min_size = sizeof(struct sparse_header) + 2 * sizeof(struct sparse_chunk_header) +
+		   sparse->block_size + piece_trailer(sparse);
+	if (sparse->max_size && sparse->max_size < min_size) {
+		image_error(image, "max-size %llu invalid. It must be at least %llu!\n",
+			    sparse->max_size, min_size);
+		return -EINVAL;
+	}
+	/* the output file is not created, only the pieces */
+	if (sparse->max_size)
+		image->no_cache = cfg_true;
+
 	image->handler_priv = sparse;
 	return 0;
 }
@@ -408,6 +916,7 @@ static cfg_opt_t android_sparse_opts[] = {
 	CFG_STR("block-size", "4k", CFGF_NONE),
 	CFG_BOOL("fill-holes", cfg_false, CFGF_NONE),
 	CFG_BOOL("add-crc", cfg_false, CFGF_NONE),
+	CFG_STR("max-size", NULL, CFGF_NONE),
 	CFG_END()
 };
 
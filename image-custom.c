@@ -89,6 +89,7 @@ static cfg_opt_t custom_opts[] = {
 
 struct image_handler custom_handler = {
 	.type = "custom",
+	.no_cache = cfg_true,
 	.generate = custom_generate,
 	.setup = custom_setup,
 	.parse = custom_parse,
@@ -40,7 +40,7 @@ static int file_generate(struct image *image)
 	if (!strcmp(f->infile, imageoutfile(image)))
 		return 0;
 
-	ret = systemp(image, "cp '%s' '%s'", f->infile, imageoutfile(image));
+	ret = spawnl(image, "cp", f->infile, imageoutfile(image), NULL);
 
 	return ret;
 }
@@ -68,6 +68,14 @@ static int file_setup(struct image *image, cfg_t *cfg)
 			    strerror(errno));
 		return ret;
 	}
+	if (cfg)
+		image->sparse_input = cfg_getbool(cfg, "sparse-input");
+	/* the size of the data, not of the sparse image itself */
+	if (image->sparse_input && !image->size) {
+		ret = sparse_image_size(image, f->infile, &image->size);
+		if (ret)
+			return ret;
+	}
 	if (!image->size)
 		image->size = s.st_size;
 
@@ -103,11 +111,13 @@ static cfg_opt_t file_opts[] = {
 	CFG_STR("name", NULL, CFGF_NONE),
 	CFG_BOOL("copy", cfg_true, CFGF_NONE),
 	CFG_STR_LIST("holes", NULL, CFGF_NONE),
+	CFG_BOOL("sparse-input", cfg_false, CFGF_NONE),
 	CFG_END()
 };
 
 struct image_handler file_handler = {
 	.type = "file",
+	.no_cache = cfg_true,
 	.generate = file_generate,
 	.setup = file_setup,
 	.parse = file_parse,
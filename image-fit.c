@@ -41,6 +41,7 @@ static int fit_generate(struct image *image)
 	int ret;
 	struct partition *part, *its;
 	char *itspath;
+	char *slug;
 	int itsfd;
 	char *keydir = cfg_getstr(image->imagesec, "keydir");
 	char *keyopt = NULL;
@@ -51,7 +52,9 @@ static int fit_generate(struct image *image)
 
 	struct image *itsimg = image_get(its->image);
 
-	xasprintf(&itspath, "%s/fit.its", tmppath());
+	slug = sanitize_path(image->file);
+	xasprintf(&itspath, "%s/fit-%s.its", tmppath(), slug);
+	free(slug);
 
 	/* Copy input its file to temporary path. Use 'cat' to ignore permissions */
 	ret = systemp(image, "cat '%s' > '%s'", imageoutfile(itsimg), itspath);
@@ -119,6 +122,8 @@ static cfg_opt_t fit_opts[] = {
 struct image_handler fit_handler = {
 	.type = "fit",
 	.no_rootpath = cfg_true,
+	/* the .its may reference arbitrary files with /incbin/ */
+	.no_cache = cfg_true,
 	.generate = fit_generate,
 	.parse = fit_parse,
 	.opts = fit_opts,
@@ -32,6 +32,7 @@ struct flash_image {
 static int flash_generate(struct image *image)
 {
 	struct partition *part;
+	struct image_writer *w;
 	unsigned long long end = 0;
 	int ret;
 
@@ -39,6 +40,10 @@ static int flash_generate(struct image *image)
 	if (ret < 0)
 		return ret;
 
+	ret = writer_open(image, &w);
+	if (ret)
+		return ret;
+
 	list_for_each_entry(part, &image->partitions, list) {
 		struct image *child = NULL;
 
@@ -46,35 +51,39 @@ static int flash_generate(struct image *image)
 			   part->name, part->size, part->offset);
 
 		if (part->offset > end) {
-			ret = insert_image(image, NULL, part->offset - end, end, 0, 0xFF, cfg_false);
+			ret = writer_insert_image(w, NULL, part->offset - end, end, 0,
+						  0xFF, cfg_false, cfg_false);
 			if (ret) {
 				image_error(image, "failed to pad image to size %lld\n",
 					    part->offset);
-				return ret;
+				goto out;
 			}
 		}
 
 		if (part->image)
 			child = image_get(part->image);
 
-		ret = insert_image(image, child, part->size, part->offset, 0, 0xFF, cfg_false);
+		ret = writer_insert_image(w, child, part->size, part->offset, 0,
+					  0xFF, cfg_false, cfg_false);
 		if (ret) {
 			image_error(image, "failed to write image partition '%s'\n",
 				    part->name);
-			return ret;
+			goto out;
 		}
 		end = part->offset + part->size;
 	}
 	if (image->size > end) {
-		ret = insert_image(image, NULL, image->size - end, end, 0, 0xFF, cfg_false);
+		ret = writer_insert_image(w, NULL, image->size - end, end, 0,
+					  0xFF, cfg_false, cfg_false);
 		if (ret) {
 			image_error(image, "failed to pad image to size %lld\n",
 				    image->size);
-			return ret;
+			goto out;
 		}
 	}
 
-	return 0;
+out:
+	return writer_close(w) ?: ret;
 }
 
 static int flash_setup(struct image *image, cfg_t *cfg)
@@ -162,6 +171,8 @@ static cfg_opt_t flash_opts[] = {
 struct image_handler flash_handler = {
 	.type = "flash",
 	.no_rootpath = cfg_true,
+	/* the children are written with writer_insert_image() */
+	.sparse_input = cfg_true,
 	.generate = flash_generate,
 	.setup = flash_setup,
 	.opts = flash_opts,
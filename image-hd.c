@@ -136,7 +136,8 @@ static void hdimage_setup_chs(struct mbr_partition_entry *entry,
 		   entry->last_chs);
 }
 
-static int hdimage_insert_mbr(struct image *image, struct list_head *partitions)
+static int hdimage_insert_mbr(struct image *image, struct image_writer *w,
+			      struct list_head *partitions)
 {
 	struct hdimage *hd = image->handler_priv;
 	struct mbr_tail mbr;
@@ -192,7 +193,7 @@ static int hdimage_insert_mbr(struct image *image, struct list_head *partitions)
 
 	mbr.boot_signature = htole16(0xaa55);
 
-	ret = insert_data(image, &mbr, imageoutfile(image), sizeof(mbr), 440);
+	ret = writer_insert_data(w, &mbr, sizeof(mbr), 440);
 	if (ret) {
 		if (hd->table_type == TYPE_HYBRID) {
 			image_error(image, "failed to write hybrid MBR\n");
@@ -205,7 +206,8 @@ static int hdimage_insert_mbr(struct image *image, struct list_head *partitions)
 	return 0;
 }
 
-static int hdimage_insert_ebr(struct image *image, struct partition *part)
+static int hdimage_insert_ebr(struct image *image, struct image_writer *w,
+			      struct partition *part)
 {
 	struct hdimage *hd = image->handler_priv;
 	struct mbr_partition_entry *entry;
@@ -245,8 +247,7 @@ static int hdimage_insert_ebr(struct image *image, struct partition *part)
 	part_table[0] = 0x55;
 	part_table[1] = 0xaa;
 
-	ret = insert_data(image, ebr, imageoutfile(image), sizeof(ebr),
-			  ebr_offset);
+	ret = writer_insert_data(w, ebr, sizeof(ebr), ebr_offset);
 	if (ret) {
 		image_error(image, "failed to write EBR\n");
 		return ret;
@@ -437,7 +438,7 @@ gpt_partition_type_lookup(const char *shortcut)
 	return NULL;
 }
 
-static int hdimage_insert_protective_mbr(struct image *image)
+static int hdimage_insert_protective_mbr(struct image *image, struct image_writer *w)
 {
 	struct partition mbr;
 	struct list_head mbr_list = LIST_HEAD_INIT(mbr_list);
@@ -451,7 +452,7 @@ static int hdimage_insert_protective_mbr(struct image *image)
 	mbr.in_partition_table = 1;
 	mbr.partition_type = 0xee;
 	list_add_tail(&mbr.list, &mbr_list);
-	ret = hdimage_insert_mbr(image, &mbr_list);
+	ret = hdimage_insert_mbr(image, w, &mbr_list);
 	if (ret) {
 		image_error(image, "failed to write protective MBR\n");
 		return ret;
@@ -460,10 +461,10 @@ static int hdimage_insert_protective_mbr(struct image *image)
 	return 0;
 }
 
-static int hdimage_insert_gpt(struct image *image, struct list_head *partitions)
+static int hdimage_insert_gpt(struct image *image, struct image_writer *w,
+			      struct list_head *partitions)
 {
 	struct hdimage *hd = image->handler_priv;
-	const char *outfile = imageoutfile(image);
 	struct gpt_header header;
 	struct gpt_partition_entry table[GPT_ENTRIES];
 	unsigned long long smallest_offset = ~0ULL, first_usable_offset = 0;
@@ -532,19 +533,19 @@ static int hdimage_insert_gpt(struct image *image, struct list_head *partitions)
 	header.table_crc = htole32(crc32(table, sizeof(table)));
 
 	header.header_crc = htole32(crc32(&header, sizeof(header)));
-	ret = insert_data(image, &header, outfile, sizeof(header), 512);
+	ret = writer_insert_data(w, &header, sizeof(header), 512);
 	if (ret) {
 		image_error(image, "failed to write GPT\n");
 		return ret;
 	}
-	ret = insert_data(image, &table, outfile, sizeof(table), hd->gpt_location);
+	ret = writer_insert_data(w, &table, sizeof(table), hd->gpt_location);
 	if (ret) {
 		image_error(image, "failed to write GPT table\n");
 		return ret;
 	}
 
 	if (!hd->gpt_no_backup) {
-		ret = extend_file(image, image->size);
+		ret = writer_extend(w, image->size);
 		if (ret) {
 			image_error(image, "failed to pad image to size %lld\n",
 				    image->size);
@@ -556,14 +557,14 @@ static int hdimage_insert_gpt(struct image *image, struct list_head *partitions)
 		header.backup_lba = htole64(1);
 		header.starting_lba = htole64(image->size / 512 - GPT_SECTORS);
 		header.header_crc = htole32(crc32(&header, sizeof(header)));
-		ret = insert_data(image, &table, outfile, sizeof(table),
-				  image->size - GPT_SECTORS * 512);
+		ret = writer_insert_data(w, &table, sizeof(table),
+					 image->size - GPT_SECTORS * 512);
 		if (ret) {
 			image_error(image, "failed to write backup GPT table\n");
 			return ret;
 		}
-		ret = insert_data(image, &header, outfile, sizeof(header),
-				  image->size - 512);
+		ret = writer_insert_data(w, &header, sizeof(header),
+					 image->size - 512);
 		if (ret) {
 			image_error(image, "failed to write backup GPT\n");
 			return ret;
@@ -571,9 +572,9 @@ static int hdimage_insert_gpt(struct image *image, struct list_head *partitions)
 	}
 
 	if (hd->table_type == TYPE_HYBRID) {
-		ret = hdimage_insert_mbr(image, partitions);
+		ret = hdimage_insert_mbr(image, w, partitions);
 	} else {
-		ret = hdimage_insert_protective_mbr(image);
+		ret = hdimage_insert_protective_mbr(image, w);
 	}
 	if (ret) {
 		return ret;
@@ -586,6 +587,7 @@ static int hdimage_generate(struct image *image)
 {
 	struct partition *part;
 	struct hdimage *hd = image->handler_priv;
+	struct image_writer *w;
 	struct stat s;
 	int ret;
 
@@ -593,6 +595,10 @@ static int hdimage_generate(struct image *image)
 	if (ret < 0)
 		return ret;
 
+	ret = writer_open(image, &w);
+	if (ret)
+		return ret;
+
 	list_for_each_entry(part, &image->partitions, list) {
 		struct image *child;
 		unsigned long long data_size;
@@ -606,10 +612,10 @@ static int hdimage_generate(struct image *image)
 			   part->image ? "'" : "");
 
 		if (part->logical) {
-			ret = hdimage_insert_ebr(image, part);
+			ret = hdimage_insert_ebr(image, w, part);
 			if (ret) {
 				image_error(image, "failed to write EBR\n");
-				return ret;
+				goto out;
 			}
 		}
 
@@ -624,45 +630,50 @@ static int hdimage_generate(struct image *image)
 		if (part->imageoffset > child->size) {
 			image_error(image, "size %lld of %s is too small for imageoffset %lld\n",
 				    child->size, child->name, part->imageoffset);
-			return -E2BIG;
+			ret = -E2BIG;
+			goto out;
 		}
 		data_size = child->size - part->imageoffset;
 
 		if (data_size > part->size) {
 			image_error(image, "part %s size (%lld) too small for %s (%lld)\n",
 				    part->name, part->size, child->file, data_size);
-			return -E2BIG;
+			ret = -E2BIG;
+			goto out;
 		}
 
-		ret = insert_image(image, child, part->fill ? part->size : data_size,
-				   part->offset, part->imageoffset, 0, part->sparse);
+		ret = writer_insert_image(w, child, part->fill ? part->size : data_size,
+					  part->offset, part->imageoffset, 0, part->sparse,
+					  part->detect_zeros);
 		if (ret) {
 			image_error(image, "failed to write image partition '%s'\n",
 				    part->name);
-			return ret;
+			goto out;
 		}
 	}
 
 	if (hd->table_type != TYPE_NONE) {
-		if (hd->table_type & TYPE_GPT) {
-			ret = hdimage_insert_gpt(image, &image->partitions);
-			if (ret)
-				return ret;
-		} else {
-			ret = hdimage_insert_mbr(image, &image->partitions);
-			if (ret)
-				return ret;
-		}
+		if (hd->table_type & TYPE_GPT)
+			ret = hdimage_insert_gpt(image, w, &image->partitions);
+		else
+			ret = hdimage_insert_mbr(image, w, &image->partitions);
+		if (ret)
+			goto out;
 	}
 
 	if (hd->fill) {
-		ret = extend_file(image, image->size);
+		ret = writer_extend(w, image->size);
 		if (ret) {
 			image_error(image, "failed to fill the image.\n");
-			return ret;
+			goto out;
 		}
 	}
 
+out:
+	ret = writer_close(w) ?: ret;
+	if (ret)
+		return ret;
+
 	if (!is_block_device(imageoutfile(image))) {
 		ret = stat(imageoutfile(image), &s);
 		if (ret) {
@@ -1236,6 +1247,8 @@ static cfg_opt_t hdimage_opts[] = {
 struct image_handler hdimage_handler = {
 	.type = "hdimage",
 	.no_rootpath = cfg_true,
+	/* the children are written with writer_insert_image() */
+	.sparse_input = cfg_true,
 	.generate = hdimage_generate,
 	.setup = hdimage_setup,
 	.opts = hdimage_opts,
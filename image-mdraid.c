@@ -124,6 +124,11 @@ typedef struct mdraid_img_s {
 	bitmap_super_t bsb;
 	/* This is counter used by slave devices to take roles */
 	__le16 last_role;
+	/* Role of this device in array */
+	__le16 role;
+	/* UUIDs of the array and this device */
+	char *raid_uuid;
+	char *disk_uuid;
 } mdraid_img_t;
 
 static unsigned int calc_sb_1_csum(struct mdp_superblock_1 *sb)
@@ -166,19 +171,7 @@ static int mdraid_generate(struct image *image)
 		max_devices = cfg_getint(image->imagesec, "devices");
 	}
 
-	/* Determine role of this device in array */
-	__le16 role = cfg_getint(image->imagesec, "role");
-	if (cfg_getint(image->imagesec, "role") == -1) {
-		/* If role is -1 it should be autoassigned to parenting devices */
-		if (mdp) {
-			/* Take role from master and increment its counter */
-			role = ++mdp->last_role;
-		} else {
-			/* Master has role of 0 */
-			role = 0;
-		}
-		image_info(image, "MDRAID automaticaly assigned role %d.\n", role);
-	}
+	__le16 role = md->role;
 
 	if (role > MD_DISK_ROLE_MAX) {
 		image_error(image, "MDRAID role has to be >= 0 and <= %d.\n", MD_DISK_ROLE_MAX);
@@ -215,11 +208,8 @@ static int mdraid_generate(struct image *image)
 		/* always set to 0 when writing */
 		sb->pad0 = 0;
 
-		char *raid_uuid = cfg_getstr(image->imagesec, "raid-uuid");
-		if (!raid_uuid)
-			raid_uuid = uuid_random();
 		/* user-space generated. U8[16] */
-		uuid_parse(raid_uuid, sb->set_uuid);
+		uuid_parse(md->raid_uuid, sb->set_uuid);
 
 		strncpy(sb->set_name, name, 32);
 		/* set and interpreted by user-space. CHAR[32] */
@@ -265,11 +255,8 @@ static int mdraid_generate(struct image *image)
 	/* number of read errors that were corrected by re-writing */
 	sb->cnt_corrected_read = 0;
 
-	char *disk_uuid = cfg_getstr(image->imagesec, "disk-uuid");
-	if (!disk_uuid)
-		disk_uuid = uuid_random();
 	/* user-space setable, ignored by kernel U8[16] */
-	uuid_parse(disk_uuid, sb->device_uuid);
+	uuid_parse(md->disk_uuid, sb->device_uuid);
 
 	/* per-device flags.  Only two defined... */
 	sb->devflags = 0;
@@ -358,29 +345,33 @@ static int mdraid_generate(struct image *image)
 	}
 
 	/* Construct image file */
+	struct image_writer *w;
 	int ret;
 	ret = prepare_image(image, image->size);
 	if (ret)
 		return ret;
-	/* Write superblock */
-	ret = insert_data(image, sb, imageoutfile(image), superblock_size, sb->super_offset * 512);
+	ret = writer_open(image, &w);
 	if (ret)
 		return ret;
+	/* Write superblock */
+	ret = writer_insert_data(w, sb, superblock_size, sb->super_offset * 512);
+	if (ret)
+		goto out;
 	/* Write bitmap */
 	if (sb->feature_map & MD_FEATURE_BITMAP_OFFSET) {
-		ret = insert_data(image, bsb, imageoutfile(image), sizeof(*bsb),
-				  (sb->super_offset + sb->bitmap_offset) * 512);
+		ret = writer_insert_data(w, bsb, sizeof(*bsb),
+					 (sb->super_offset + sb->bitmap_offset) * 512);
 		if (ret)
-			return ret;
+			goto out;
 	}
 	/* Write data */
-	if (md->img_data) {
-		ret = insert_image(image, md->img_data, md->img_data->size, DATA_OFFSET_BYTES, 0, 0, cfg_true);
-		if (ret)
-			return ret;
-	}
+	if (md->img_data)
+		ret = writer_insert_image(w, md->img_data, md->img_data->size,
+					  DATA_OFFSET_BYTES, 0, 0, cfg_true,
+					  get_detect_zeros());
 
-	return 0;
+out:
+	return writer_close(w) ?: ret;
 }
 
 static int mdraid_parse(struct image *image, cfg_t *cfg)
@@ -456,6 +447,36 @@ static int mdraid_setup(struct image *image, cfg_t *cfg)
 		image_info(image, "MDRAID is created without data.\n");
 	}
 
+	/*
+	 * Roles and random UUIDs are assigned here rather than in generate:
+	 * setup runs in a fixed order while images may be generated
+	 * concurrently.
+	 */
+	md->role = cfg_getint(image->imagesec, "role");
+	if (cfg_getint(image->imagesec, "role") == -1) {
+		/* If role is -1 it should be autoassigned to parenting devices */
+		if (md->img_parent) {
+			mdraid_img_t *mdp = md->img_parent->handler_priv;
+
+			/* Take role from master and increment its counter */
+			md->role = ++mdp->last_role;
+		} else {
+			/* Master has role of 0 */
+			md->role = 0;
+		}
+		image_info(image, "MDRAID automaticaly assigned role %d.\n", md->role);
+	}
+
+	if (!md->img_parent) {
+		md->raid_uuid = cfg_getstr(image->imagesec, "raid-uuid");
+		if (!md->raid_uuid)
+			md->raid_uuid = uuid_random();
+	}
+
+	md->disk_uuid = cfg_getstr(image->imagesec, "disk-uuid");
+	if (!md->disk_uuid)
+		md->disk_uuid = uuid_random();
+
 	/* Make sure size is aligned */
 	if (image->size != roundup(image->size, MDRAID_ALIGN_BYTES)) {
 		image_error(image, "MDRAID image size has to be aligned to %d bytes!\n", MDRAID_ALIGN_BYTES);
@@ -481,6 +502,9 @@ static cfg_opt_t mdraid_opts[] = {
 struct image_handler mdraid_handler = {
 	.type = "mdraid",
 	.no_rootpath = cfg_true,
+	/* the children are written with writer_insert_image() */
+	.sparse_input = cfg_true,
+	.no_cache = cfg_true,
 	.parse = mdraid_parse,
 	.setup = mdraid_setup,
 	.generate = mdraid_generate,
@@ -43,13 +43,16 @@ static int rauc_generate(struct image *image)
 	char *keyringarg = NULL;
 	char *manifest_file = NULL;
 	char *tmpdir = NULL;
+	char *slug;
 	char *intermediatearg = NULL;
 	unsigned int i;
 
 	image_debug(image, "manifest = '%s'\n", manifest);
 
-	xasprintf(&tmpdir, "%s/rauc-%s", tmppath(), sanitize_path(image->file));
-	ret = systemp(image, "mkdir -p '%s'", tmpdir);
+	slug = sanitize_path(image->file);
+	xasprintf(&tmpdir, "%s/rauc-%s", tmppath(), slug);
+	free(slug);
+	ret = spawnl(image, "mkdir", "-p", tmpdir, NULL);
 	if (ret)
 		goto out;
 
@@ -100,9 +103,12 @@ static int rauc_generate(struct image *image)
 		path = strdupa(target);
 		tmp = strrchr(path, '/');
 		if (tmp) {
+			char *dir;
+
 			*tmp = '\0';
-			ret = systemp(image, "mkdir -p '%s/%s'",
-				      tmpdir, path);
+			xasprintf(&dir, "%s/%s", tmpdir, path);
+			ret = spawnl(image, "mkdir", "-p", dir, NULL);
+			free(dir);
 			if (ret)
 				goto out;
 		}
@@ -126,12 +132,19 @@ static int rauc_generate(struct image *image)
 			 * support part->imageoffset != 0 and then it can
 			 * replace both commands.
 			 */
-			ret = systemp(image, "dd if='%s' of='%s' iflag=skip_bytes skip=%lld",
-				      file, tmptarget, part->imageoffset);
+			char *in, *of, *skip;
+
+			xasprintf(&in, "if=%s", file);
+			xasprintf(&of, "of=%s", tmptarget);
+			xasprintf(&skip, "skip=%lld", part->imageoffset);
+			ret = spawnl(image, "dd", in, of, "iflag=skip_bytes", skip, NULL);
+			free(in);
+			free(of);
+			free(skip);
 
 		} else {
-			ret = systemp(image, "cp --remove-destination '%s' '%s'",
-				      file, tmptarget);
+			ret = spawnl(image, "cp", "--remove-destination", file,
+				     tmptarget, NULL);
 		}
 
 		free(tmptarget);
@@ -142,7 +155,7 @@ static int rauc_generate(struct image *image)
 	if (keyring)
 		xasprintf(&keyringarg, "--keyring='%s'", keyring);
 
-	systemp(image, "rm -f '%s'", imageoutfile(image));
+	spawnl(image, "rm", "-f", imageoutfile(image), NULL);
 
 	ret = systemp(image, "%s bundle '%s' --cert='%s' --key='%s' %s %s %s '%s'",
 		      get_opt("rauc"), tmpdir, cert, key,
@@ -265,6 +278,8 @@ static cfg_opt_t rauc_opts[] = {
 struct image_handler rauc_handler = {
 	.type = "rauc",
 	.no_rootpath = cfg_true,
+	/* the key and certs may be files, PKCS#11 URIs or set in extraargs */
+	.no_cache = cfg_true,
 	.generate = rauc_generate,
 	.parse = rauc_parse,
 	.setup = rauc_setup,
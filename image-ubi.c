@@ -30,11 +30,14 @@ static int ubi_generate(struct image *image)
 	int ret;
 	FILE *fini;
 	char *tempfile;
+	char *slug;
 	int i = 0;
 	struct partition *part;
 	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
 
-	xasprintf(&tempfile, "%s/ubi.ini", tmppath());
+	slug = sanitize_path(image->file);
+	xasprintf(&tempfile, "%s/ubi-%s.ini", tmppath(), slug);
+	free(slug);
 	if (!tempfile)
 		return -ENOMEM;
 
@@ -300,6 +300,7 @@ static cfg_opt_t verity_sig_opts[] = {
 struct image_handler verity_sig_handler = {
 	.type = "verity-sig",
 	.no_rootpath = cfg_true,
+	.no_cache = cfg_true,
 	.generate = verity_sig_generate,
 	.parse = verity_sig_parse,
 	.opts = verity_sig_opts,
@@ -375,6 +376,7 @@ static cfg_opt_t verity_opts[] = {
 struct image_handler verity_handler = {
 	.type = "verity",
 	.no_rootpath = cfg_true,
+	.no_cache = cfg_true,
 	.generate = verity_generate,
 	.parse = verity_parse,
 	.opts = verity_opts,
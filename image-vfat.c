@@ -19,9 +19,57 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <dirent.h>
 
 #include "genimage.h"
 
+static int filter_hidden(const struct dirent *d)
+{
+	return d->d_name[0] != '.';
+}
+
+/*
+ * copy all non-hidden entries of @dir to the root directory of the image,
+ * like 'mcopy -sp -i <image> <dir>/<glob> ::'
+ */
+static int vfat_copy_dir(struct image *image, const char *dir)
+{
+	struct dirent **namelist;
+	const char **argv;
+	int i, n, argc = 0, ret;
+
+	n = scandir(dir, &namelist, filter_hidden, alphasort);
+	if (n < 0) {
+		ret = -errno;
+		image_error(image, "failed to scan '%s': %s\n", dir, strerror(errno));
+		return ret;
+	}
+	if (!n) {
+		free(namelist);
+		return 0;
+	}
+
+	argv = xzalloc((n + 6) * sizeof(*argv));
+	argv[argc++] = get_opt("mcopy");
+	argv[argc++] = "-sp";
+	argv[argc++] = "-i";
+	argv[argc++] = imageoutfile(image);
+	for (i = 0; i < n; i++)
+		xasprintf((char **)&argv[argc++], "%s/%s", dir, namelist[i]->d_name);
+	argv[argc++] = "::";
+
+	ret = spawnv(image, (char *const *)argv, NULL, NULL);
+
+	for (i = 0; i < n; i++) {
+		free((char *)argv[4 + i]);
+		free(namelist[i]);
+	}
+	free(namelist);
+	free(argv);
+
+	return ret;
+}
+
 static int vfat_generate(struct image *image)
 {
 	int ret;
@@ -43,27 +91,33 @@ static int vfat_generate(struct image *image)
 	if (ret)
 		return ret;
 
+	image_setenv(image, "MTOOLS_SKIP_CHECK", "1");
+
 	list_for_each_entry(part, &image->partitions, list) {
 		struct image *child = image_get(part->image);
 		const char *file = imageoutfile(child);
 		const char *target = part->name;
 		char *path = strdupa(target);
 		char *next = path;
+		char *dest;
 
 		while ((next = strchr(next, '/')) != NULL) {
 			*next = '\0';
+			xasprintf(&dest, "::%s", path);
 			/* ignore the error: mdd fails if the target exists. */
-			systemp(image, "MTOOLS_SKIP_CHECK=1 %s -DsS -i %s '::%s'",
-				get_opt("mmd"), imageoutfile(image), path);
+			spawnl(image, get_opt("mmd"), "-DsS", "-i", imageoutfile(image),
+			       dest, NULL);
+			free(dest);
 			*next = '/';
 			++next;
 		}
 
 		image_info(image, "adding file '%s' as '%s' ...\n",
 			   child->file, *target ? target : child->file);
-		ret = systemp(image, "MTOOLS_SKIP_CHECK=1 %s -sp -i '%s' '%s' '::%s'",
-			      get_opt("mcopy"), imageoutfile(image),
-			      file, target);
+		xasprintf(&dest, "::%s", target);
+		ret = spawnl(image, get_opt("mcopy"), "-sp", "-i", imageoutfile(image),
+			     file, dest, NULL);
+		free(dest);
 		if (ret)
 			return ret;
 	}
@@ -71,8 +125,7 @@ static int vfat_generate(struct image *image)
 		return 0;
 
 	if (!image->empty)
-		ret = systemp(image, "MTOOLS_SKIP_CHECK=1 %s -sp -i '%s' '%s'/* ::",
-			      get_opt("mcopy"), imageoutfile(image), mountpath(image));
+		ret = vfat_copy_dir(image, mountpath(image));
 	return ret;
 }
 
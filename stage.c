@@ -0,0 +1,747 @@
+/*
+ * Stage the rootpath into the tmppath
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is the equivalent of 'cp -a <rootpath> <tmppath>/root' followed by
+ * moving each mountpoint to its own directory. The tree is walked by
+ * multiple threads. Each directory is one work item. The metadata of a
+ * directory is set once all its subdirectories are done, so the
+ * timestamps are not modified by creating entries later on.
+ *
+ * With a persistent stagedir, the destination is synced instead: entries
+ * that are unchanged in type, mode, owner, size and mtime are kept,
+ * everything else is replaced and entries that no longer exist in the
+ * rootpath are removed.
+ */
+
+#include <confuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
+#include "genimage.h"
+
+#define INODE_HASH_SIZE 1024
+
+struct stage_dir {
+	char *src;
+	char *dst;
+	char *rel;
+	struct stat st;
+	struct stage_dir *parent;
+	/* this directory and all subdirectories that are not done */
+	int pending;
+	struct list_head list;
+};
+
+/* files with multiple links that were already staged */
+struct stage_inode {
+	dev_t dev;
+	ino_t ino;
+	char *dst;
+	struct hlist_node hash;
+};
+
+struct stage {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head queue;
+	int active;
+	int ret;
+	int link;
+	int sync;
+	int check_owner;
+	struct list_head *mountpoints;
+	pthread_mutex_t inode_lock;
+	struct hlist_head inodes[INODE_HASH_SIZE];
+};
+
+static void stage_set_error(struct stage *stage, int ret)
+{
+	pthread_mutex_lock(&stage->lock);
+	if (!stage->ret)
+		stage->ret = ret;
+	pthread_cond_broadcast(&stage->cond);
+	pthread_mutex_unlock(&stage->lock);
+}
+
+static void copy_xattrs(const char *src, const char *dst)
+{
+#ifdef HAVE_SYS_XATTR_H
+	char *names, *name, *value = NULL;
+	ssize_t len, vlen, size = 0;
+
+	len = llistxattr(src, NULL, 0);
+	if (len <= 0)
+		return;
+	names = xzalloc(len);
+	len = llistxattr(src, names, len);
+
+	/* like 'cp -a', failing to preserve xattrs is not an error */
+	for (name = names; len > 0 && name < names + len; name += strlen(name) + 1) {
+		vlen = lgetxattr(src, name, NULL, 0);
+		if (vlen < 0)
+			continue;
+		if (vlen > size) {
+			size = vlen;
+			value = xrealloc(value, size);
+		}
+		vlen = lgetxattr(src, name, value, vlen);
+		if (vlen >= 0)
+			lsetxattr(dst, name, value, vlen, 0);
+	}
+	free(value);
+	free(names);
+#endif
+}
+
+/*
+ * Set owner, mode and timestamps. The mode is set after the owner, because
+ * chown() clears the setuid and setgid bits.
+ */
+static int set_metadata(const char *dst, const struct stat *st)
+{
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	int ret;
+
+	/* only root can change the owner, just like 'cp -a' */
+	if (lchown(dst, st->st_uid, st->st_gid) && errno != EPERM) {
+		ret = -errno;
+		error("chown %s: %s\n", dst, strerror(errno));
+		return ret;
+	}
+	if (!S_ISLNK(st->st_mode) && chmod(dst, st->st_mode & 07777)) {
+		ret = -errno;
+		error("chmod %s: %s\n", dst, strerror(errno));
+		return ret;
+	}
+	if (utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW)) {
+		ret = -errno;
+		error("utimensat %s: %s\n", dst, strerror(errno));
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * 'rm -rf @path'. Directories are made writable first, so read-only
+ * directories can be removed without being root.
+ */
+int remove_tree(const char *path)
+{
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+	int ret = 0;
+
+	if (lstat(path, &st))
+		return errno == ENOENT ? 0 : -errno;
+
+	if (!S_ISDIR(st.st_mode)) {
+		if (unlink(path)) {
+			ret = -errno;
+			error("unlink %s: %s\n", path, strerror(errno));
+		}
+		return ret;
+	}
+
+	chmod(path, 0700);
+	dir = opendir(path);
+	if (!dir) {
+		ret = -errno;
+		error("opendir %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+	while (!ret && (d = readdir(dir))) {
+		char *sub;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		xasprintf(&sub, "%s/%s", path, d->d_name);
+		ret = remove_tree(sub);
+		free(sub);
+	}
+	closedir(dir);
+
+	if (!ret && rmdir(path)) {
+		ret = -errno;
+		error("rmdir %s: %s\n", path, strerror(errno));
+	}
+	return ret;
+}
+
+static int stage_unchanged(struct stage *stage, const struct stat *src,
+			   const struct stat *dst)
+{
+	/* without root, the owner is not preserved */
+	if (stage->check_owner &&
+	    (src->st_uid != dst->st_uid || src->st_gid != dst->st_gid))
+		return 0;
+
+	return src->st_mode == dst->st_mode &&
+	       src->st_size == dst->st_size &&
+	       src->st_rdev == dst->st_rdev &&
+	       src->st_mtim.tv_sec == dst->st_mtim.tv_sec &&
+	       src->st_mtim.tv_nsec == dst->st_mtim.tv_nsec;
+}
+
+static int stage_file(struct stage *stage, const char *src, const char *dst,
+		      const struct stat *st)
+{
+	int in, out, ret;
+
+	in = open(src, O_RDONLY);
+	if (in < 0) {
+		ret = -errno;
+		error("open %s: %s\n", src, strerror(errno));
+		return ret;
+	}
+	out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (out < 0) {
+		ret = -errno;
+		error("open %s: %s\n", dst, strerror(errno));
+		close(in);
+		return ret;
+	}
+
+	if (stage->link) {
+#ifdef FICLONE
+		if (ioctl(out, FICLONE, in) == 0)
+			goto metadata;
+#endif
+		/*
+		 * The file is shared with the rootpath, so the metadata is
+		 * already correct.
+		 */
+		close(out);
+		unlink(dst);
+		if (link(src, dst) == 0) {
+			close(in);
+			return 0;
+		}
+		out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (out < 0) {
+			ret = -errno;
+			error("open %s: %s\n", dst, strerror(errno));
+			close(in);
+			return ret;
+		}
+	}
+
+	ret = copy_fd(in, out, st->st_size);
+	if (ret) {
+		error("copy %s: %s\n", src, strerror(-ret));
+		goto out;
+	}
+#ifdef FICLONE
+metadata:
+#endif
+	copy_xattrs(src, dst);
+	ret = set_metadata(dst, st);
+out:
+	close(in);
+	if (close(out) && !ret) {
+		ret = -errno;
+		error("close %s: %s\n", dst, strerror(errno));
+	}
+	return ret;
+}
+
+static int stage_entry(struct stage *stage, const char *src, const char *dst,
+		       const struct stat *st)
+{
+	int ret;
+
+	if (S_ISREG(st->st_mode))
+		return stage_file(stage, src, dst, st);
+
+	if (S_ISLNK(st->st_mode)) {
+		char target[PATH_MAX];
+		ssize_t len;
+
+		len = readlink(src, target, sizeof(target) - 1);
+		if (len < 0) {
+			ret = -errno;
+			error("readlink %s: %s\n", src, strerror(errno));
+			return ret;
+		}
+		target[len] = '\0';
+		if (symlink(target, dst)) {
+			ret = -errno;
+			error("symlink %s: %s\n", dst, strerror(errno));
+			return ret;
+		}
+	} else {
+		if (mknod(dst, st->st_mode, st->st_rdev)) {
+			ret = -errno;
+			error("mknod %s: %s\n", dst, strerror(errno));
+			return ret;
+		}
+		copy_xattrs(src, dst);
+	}
+
+	ret = set_metadata(dst, st);
+
+	return ret;
+}
+
+static unsigned int inode_hash(dev_t dev, ino_t ino)
+{
+	return (ino ^ (ino >> 16) ^ major(dev) ^ minor(dev)) % INODE_HASH_SIZE;
+}
+
+/*
+ * Files with more than one link are staged once, all other names are
+ * hard links to the first copy, like with 'cp -a'.
+ */
+static int stage_nondir(struct stage *stage, const char *src, const char *dst,
+			const struct stat *st)
+{
+	struct hlist_head *head;
+	struct stage_inode *inode;
+	struct hlist_node *pos;
+	int ret;
+
+	if (st->st_nlink < 2)
+		return stage_entry(stage, src, dst, st);
+
+	pthread_mutex_lock(&stage->inode_lock);
+	head = &stage->inodes[inode_hash(st->st_dev, st->st_ino)];
+	hlist_for_each_entry(inode, pos, head, hash) {
+		if (inode->dev == st->st_dev && inode->ino == st->st_ino) {
+			ret = 0;
+			if (link(inode->dst, dst)) {
+				ret = -errno;
+				error("link %s: %s\n", dst, strerror(errno));
+			}
+			pthread_mutex_unlock(&stage->inode_lock);
+			return ret;
+		}
+	}
+	ret = stage_entry(stage, src, dst, st);
+	if (!ret) {
+		inode = xzalloc(sizeof(*inode));
+		inode->dev = st->st_dev;
+		inode->ino = st->st_ino;
+		inode->dst = strdup(dst);
+		hlist_add_head(&inode->hash, head);
+	}
+	pthread_mutex_unlock(&stage->inode_lock);
+
+	return ret;
+}
+
+/*
+ * An unchanged file with multiple links was kept. Remember it for the
+ * other names of the file and make sure it is linked to a copy that was
+ * already staged.
+ */
+static int stage_keep(struct stage *stage, const char *dst, const struct stat *st,
+		      const struct stat *dst_st)
+{
+	struct hlist_head *head;
+	struct stage_inode *inode;
+	struct hlist_node *pos;
+	struct stat s;
+	int ret = 0;
+
+	if (st->st_nlink < 2)
+		return 0;
+
+	pthread_mutex_lock(&stage->inode_lock);
+	head = &stage->inodes[inode_hash(st->st_dev, st->st_ino)];
+	hlist_for_each_entry(inode, pos, head, hash) {
+		if (inode->dev == st->st_dev && inode->ino == st->st_ino) {
+			if (!lstat(inode->dst, &s) && s.st_ino == dst_st->st_ino)
+				goto out;
+			if (unlink(dst) || link(inode->dst, dst)) {
+				ret = -errno;
+				error("link %s: %s\n", dst, strerror(errno));
+			}
+			goto out;
+		}
+	}
+	inode = xzalloc(sizeof(*inode));
+	inode->dev = st->st_dev;
+	inode->ino = st->st_ino;
+	inode->dst = strdup(dst);
+	hlist_add_head(&inode->hash, head);
+out:
+	pthread_mutex_unlock(&stage->inode_lock);
+
+	return ret;
+}
+
+static struct mountpoint *stage_mountpoint(struct stage *stage, const char *rel)
+{
+	struct mountpoint *mp;
+	size_t len;
+
+	list_for_each_entry(mp, stage->mountpoints, list) {
+		len = strlen(mp->path);
+		while (len && mp->path[len - 1] == '/')
+			len--;
+		if (len && len == strlen(rel) && !strncmp(mp->path, rel, len))
+			return mp;
+	}
+	return NULL;
+}
+
+static void stage_queue_dir(struct stage *stage, struct stage_dir *parent,
+			    char *src, char *dst, char *rel, const struct stat *st)
+{
+	struct stage_dir *dir = xzalloc(sizeof(*dir));
+
+	dir->src = src;
+	dir->dst = dst;
+	dir->rel = rel;
+	dir->st = *st;
+	dir->parent = parent;
+	dir->pending = 1;
+
+	pthread_mutex_lock(&stage->lock);
+	if (parent)
+		parent->pending++;
+	list_add_tail(&dir->list, &stage->queue);
+	pthread_cond_signal(&stage->cond);
+	pthread_mutex_unlock(&stage->lock);
+}
+
+static int stage_mkdir(struct stage *stage, const char *dst, const struct stat *st)
+{
+	struct stat s;
+	int ret;
+
+	/* the final mode is set when the directory is done */
+	if (stage->sync && !lstat(dst, &s)) {
+		if (S_ISDIR(s.st_mode)) {
+			if (chmod(dst, 0700)) {
+				ret = -errno;
+				error("chmod %s: %s\n", dst, strerror(errno));
+				return ret;
+			}
+			goto chown;
+		}
+		ret = remove_tree(dst);
+		if (ret)
+			return ret;
+	}
+	if (mkdir(dst, 0700)) {
+		ret = -errno;
+		error("mkdir %s: %s\n", dst, strerror(errno));
+		return ret;
+	}
+chown:
+	if (lchown(dst, st->st_uid, st->st_gid) && errno != EPERM) {
+		ret = -errno;
+		error("chown %s: %s\n", dst, strerror(errno));
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * Drop the reference to @dir. The last reference sets the final metadata
+ * and drops the reference to the parent directory.
+ */
+static int stage_put_dir(struct stage *stage, struct stage_dir *dir)
+{
+	struct stage_dir *parent;
+	int ret = 0, done;
+
+	while (dir) {
+		pthread_mutex_lock(&stage->lock);
+		done = !--dir->pending;
+		pthread_mutex_unlock(&stage->lock);
+		if (!done)
+			break;
+
+		if (!ret) {
+			copy_xattrs(dir->src, dir->dst);
+			ret = set_metadata(dir->dst, &dir->st);
+		}
+
+		parent = dir->parent;
+		free(dir->src);
+		free(dir->dst);
+		free(dir->rel);
+		free(dir);
+		dir = parent;
+	}
+	return ret;
+}
+
+/*
+ * remove all entries of the destination directory that no longer exist
+ * in the rootpath.
+ */
+static int stage_prune(struct stage_dir *dir)
+{
+	struct dirent *d;
+	struct stat st;
+	DIR *dh;
+	int ret = 0;
+
+	dh = opendir(dir->dst);
+	if (!dh) {
+		ret = -errno;
+		error("opendir %s: %s\n", dir->dst, strerror(errno));
+		return ret;
+	}
+
+	while (!ret && (d = readdir(dh))) {
+		char *src, *dst;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+
+		xasprintf(&src, "%s/%s", dir->src, d->d_name);
+		if (lstat(src, &st)) {
+			if (errno == ENOENT) {
+				xasprintf(&dst, "%s/%s", dir->dst, d->d_name);
+				ret = remove_tree(dst);
+				free(dst);
+			} else {
+				ret = -errno;
+				error("stat %s: %s\n", src, strerror(errno));
+			}
+		}
+		free(src);
+	}
+	closedir(dh);
+
+	return ret;
+}
+
+static int stage_dir(struct stage *stage, struct stage_dir *dir)
+{
+	struct dirent *d;
+	DIR *dh;
+	int ret = 0;
+
+	if (stage->sync) {
+		ret = stage_prune(dir);
+		if (ret)
+			return ret;
+	}
+
+	dh = opendir(dir->src);
+	if (!dh) {
+		ret = -errno;
+		error("opendir %s: %s\n", dir->src, strerror(errno));
+		return ret;
+	}
+
+	while (!ret && (d = readdir(dh))) {
+		char *src, *dst, *rel;
+		struct mountpoint *mp;
+		struct stat st, dst_st;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+
+		xasprintf(&src, "%s/%s", dir->src, d->d_name);
+		xasprintf(&dst, "%s/%s", dir->dst, d->d_name);
+		xasprintf(&rel, "%s%s%s", dir->rel, *dir->rel ? "/" : "", d->d_name);
+
+		if (lstat(src, &st)) {
+			ret = -errno;
+			error("stat %s: %s\n", src, strerror(errno));
+		} else if (!S_ISDIR(st.st_mode)) {
+			int keep = 0;
+
+			if (stage->sync && !lstat(dst, &dst_st)) {
+				keep = !S_ISDIR(dst_st.st_mode) &&
+				       stage_unchanged(stage, &st, &dst_st);
+				if (keep)
+					ret = stage_keep(stage, dst, &st, &dst_st);
+				else
+					ret = remove_tree(dst);
+			}
+			if (!ret && !keep)
+				ret = stage_nondir(stage, src, dst, &st);
+		} else {
+			mp = stage_mountpoint(stage, rel);
+			if (mp) {
+				/*
+				 * The content goes to the mountpoint, an
+				 * empty directory is left in its place.
+				 */
+				if (stage->sync)
+					ret = remove_tree(dst);
+				if (!ret)
+					ret = stage_mkdir(stage, dst, &st);
+				if (!ret)
+					ret = set_metadata(dst, &st);
+				free(dst);
+				dst = strdup(mp->mountpath);
+				mp->staged = 1;
+			}
+			if (!ret)
+				ret = stage_mkdir(stage, dst, &st);
+			if (!ret) {
+				stage_queue_dir(stage, dir, src, dst, rel, &st);
+				continue;
+			}
+		}
+		free(src);
+		free(dst);
+		free(rel);
+	}
+	closedir(dh);
+
+	return ret;
+}
+
+static void *stage_worker(void *data)
+{
+	struct stage *stage = data;
+	struct stage_dir *dir;
+	int ret;
+
+	pthread_mutex_lock(&stage->lock);
+	while (1) {
+		while (!stage->ret && list_empty(&stage->queue) && stage->active)
+			pthread_cond_wait(&stage->cond, &stage->lock);
+		if (stage->ret || list_empty(&stage->queue))
+			break;
+
+		dir = list_first_entry(&stage->queue, struct stage_dir, list);
+		list_del(&dir->list);
+		stage->active++;
+		pthread_mutex_unlock(&stage->lock);
+
+		ret = stage_dir(stage, dir);
+		if (!ret)
+			ret = stage_put_dir(stage, dir);
+		if (ret)
+			stage_set_error(stage, ret);
+
+		pthread_mutex_lock(&stage->lock);
+		stage->active--;
+		pthread_cond_broadcast(&stage->cond);
+	}
+	pthread_cond_broadcast(&stage->cond);
+	pthread_mutex_unlock(&stage->lock);
+
+	return NULL;
+}
+
+/*
+ * Copy @src to @dst or sync @dst with @src if @sync is set. Each directory in @src that matches a non-root
+ * mountpoint in @mountpoints is copied to the mountpath of the mountpoint
+ * instead and an empty directory is created in its place.
+ */
+int stage_rootpath(const char *src, const char *dst, struct list_head *mountpoints,
+		   unsigned int jobs, int sync)
+{
+	struct stage stage = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.inode_lock = PTHREAD_MUTEX_INITIALIZER,
+		.mountpoints = mountpoints,
+		.sync = sync,
+		.check_owner = geteuid() == 0,
+	};
+	const char *mode = get_opt("stage");
+	struct mountpoint *mp;
+	struct stage_inode *inode;
+	struct hlist_node *pos, *n;
+	pthread_t *threads;
+	unsigned int num_threads = 0, i;
+	struct stat st;
+	int ret;
+
+	if (mode && !strcmp(mode, "link")) {
+		stage.link = 1;
+	} else if (mode && *mode && strcmp(mode, "copy")) {
+		error("invalid stage mode '%s'\n", mode);
+		return -EINVAL;
+	}
+
+	INIT_LIST_HEAD(&stage.queue);
+	list_for_each_entry(mp, mountpoints, list)
+		mp->staged = 0;
+
+	if (stat(src, &st)) {
+		ret = -errno;
+		error("stat %s: %s\n", src, strerror(errno));
+		return ret;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		error("rootpath %s is not a directory\n", src);
+		return -ENOTDIR;
+	}
+
+	ret = stage_mkdir(&stage, dst, &st);
+	if (ret)
+		return ret;
+	stage_queue_dir(&stage, NULL, strdup(src), strdup(dst), strdup(""), &st);
+
+	threads = xzalloc(jobs * sizeof(*threads));
+	for (i = 1; i < jobs; i++) {
+		ret = pthread_create(&threads[num_threads], NULL, stage_worker, &stage);
+		if (ret) {
+			error("failed to create worker thread: %s\n", strerror(ret));
+			break;
+		}
+		num_threads++;
+	}
+	stage_worker(&stage);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < INODE_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(inode, pos, n, &stage.inodes[i], hash) {
+			free(inode->dst);
+			free(inode);
+		}
+	}
+
+	if (stage.ret)
+		return stage.ret;
+
+	/*
+	 * Check what the walk found and not the mountpath: with a stagedir,
+	 * the latter may be left over from a previous run.
+	 */
+	list_for_each_entry(mp, mountpoints, list) {
+		if (*mp->path && !mp->staged) {
+			error("mountpoint '%s' does not exist in the rootpath\n", mp->path);
+			return -ENOENT;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Resource usage statistics
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <confuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "genimage.h"
+
+/* commands that do not belong to an image */
+static struct image_stats global_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long tv_us(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+/*
+ * account the resource usage of a command that was run for @image
+ */
+void stats_add_cmd(struct image *image, const struct rusage *ru,
+		   unsigned long long wall_us)
+{
+	struct image_stats *s = image ? &image->stats : &global_stats;
+
+	pthread_mutex_lock(&stats_lock);
+	s->cmds++;
+	s->cmd_wall_us += wall_us;
+	s->utime_us += tv_us(&ru->ru_utime);
+	s->stime_us += tv_us(&ru->ru_stime);
+	if ((unsigned long long)ru->ru_maxrss > s->maxrss_kb)
+		s->maxrss_kb = ru->ru_maxrss;
+	s->inblock += ru->ru_inblock;
+	s->oublock += ru->ru_oublock;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_add_io(struct image *image, const struct io_stats *io)
+{
+	struct io_stats *s = image ? &image->stats.io : &global_stats.io;
+
+	pthread_mutex_lock(&stats_lock);
+	s->read += io->read;
+	s->written += io->written;
+	s->cloned += io->cloned;
+	s->skipped += io->skipped;
+	s->punched += io->punched;
+	s->unchanged += io->unchanged;
+	s->writes += io->writes;
+	s->fsyncs += io->fsyncs;
+	s->fsync_us += io->fsync_us;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_sum(struct image_stats *sum, const struct image_stats *s)
+{
+	sum->cmds += s->cmds;
+	sum->cmd_wall_us += s->cmd_wall_us;
+	sum->generate_us += s->generate_us;
+	sum->utime_us += s->utime_us;
+	sum->stime_us += s->stime_us;
+	if (s->maxrss_kb > sum->maxrss_kb)
+		sum->maxrss_kb = s->maxrss_kb;
+	sum->inblock += s->inblock;
+	sum->oublock += s->oublock;
+	sum->io.read += s->io.read;
+	sum->io.written += s->io.written;
+	sum->io.cloned += s->io.cloned;
+	sum->io.skipped += s->io.skipped;
+	sum->io.punched += s->io.punched;
+	sum->io.unchanged += s->io.unchanged;
+	sum->io.writes += s->io.writes;
+	sum->io.fsyncs += s->io.fsyncs;
+	sum->io.fsync_us += s->io.fsync_us;
+}
+
+static void stats_info(const char *name, const struct image_stats *s)
+{
+	info("%-24s %5u %9.2f %9.2f %9.2f %9.2f %8.1f %9.1f %9.1f\n", name,
+	     s->cmds, s->generate_us / 1e6, s->cmd_wall_us / 1e6,
+	     s->utime_us / 1e6, s->stime_us / 1e6, s->maxrss_kb / 1024.0,
+	     s->inblock / 2048.0, s->oublock / 2048.0);
+}
+
+static void stats_io_info(const char *name, const struct io_stats *io)
+{
+	info("%-24s %10.1f %10.1f %10.1f %10.1f %10.1f %8llu %6llu %8.2f\n", name,
+	     io->read / 1048576.0, io->written / 1048576.0,
+	     io->skipped / 1048576.0, io->punched / 1048576.0,
+	     io->unchanged / 1048576.0, io->writes, io->fsyncs, io->fsync_us / 1e6);
+}
+
+static void stats_json(FILE *f, const char *name, const char *type,
+		       const struct image_stats *s)
+{
+	char *jname = json_string(name);
+
+	fprintf(f, "{\"image\":%s,\"type\":\"%s\",\"commands\":%u,"
+		"\"generate_us\":%llu,\"command_wall_us\":%llu,"
+		"\"utime_us\":%llu,\"stime_us\":%llu,\"maxrss_kb\":%llu,"
+		"\"inblock\":%llu,\"oublock\":%llu,\"io\":{\"read\":%llu,"
+		"\"written\":%llu,\"cloned\":%llu,\"skipped\":%llu,\"punched\":%llu,"
+		"\"unchanged\":%llu,\"writes\":%llu,\"fsyncs\":%llu,\"fsync_us\":%llu}}",
+		jname, type, s->cmds, s->generate_us, s->cmd_wall_us,
+		s->utime_us, s->stime_us, s->maxrss_kb, s->inblock, s->oublock,
+		s->io.read, s->io.written, s->io.cloned, s->io.skipped, s->io.punched,
+		s->io.unchanged, s->io.writes, s->io.fsyncs, s->io.fsync_us);
+	free(jname);
+}
+
+/*
+ * Print summary tables of all images and write the statistics as JSON
+ * to the file given with --stats. Block counts are in 512 byte units, the
+ * I/O done by genimage itself is in bytes.
+ */
+int stats_write(struct list_head *images)
+{
+	const char *filename = get_opt("stats");
+	struct image_stats total = { 0 };
+	struct image *image;
+	FILE *f;
+	int first = 1;
+
+	if (!filename || !*filename)
+		return 0;
+
+	f = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+	if (!f) {
+		int ret = -errno;
+		error("could not open stats file %s: %s\n", filename, strerror(errno));
+		return ret;
+	}
+
+	info("%-24s %5s %9s %9s %9s %9s %8s %9s %9s\n", "image", "cmds",
+	     "time[s]", "cmds[s]", "user[s]", "sys[s]", "rss[MiB]",
+	     "read[MiB]", "write[MiB]");
+
+	fprintf(f, "{\"images\":[\n");
+	list_for_each_entry(image, images, list) {
+		stats_info(image->file, &image->stats);
+		fprintf(f, "%s", first ? "" : ",\n");
+		stats_json(f, image->file, image->handler->type, &image->stats);
+		stats_sum(&total, &image->stats);
+		first = 0;
+	}
+	stats_info("(genimage)", &global_stats);
+	stats_sum(&total, &global_stats);
+	stats_info("total", &total);
+
+	info("%-24s %10s %10s %10s %10s %10s %8s %6s %8s\n", "image", "read[MiB]",
+	     "write[MiB]", "holes[MiB]", "punch[MiB]", "same[MiB]", "writes",
+	     "fsyncs", "fsync[s]");
+	list_for_each_entry(image, images, list)
+		stats_io_info(image->file, &image->stats.io);
+	stats_io_info("(genimage)", &global_stats.io);
+	stats_io_info("total", &total.io);
+
+	fprintf(f, "\n],\n\"genimage\":");
+	stats_json(f, "(genimage)", "", &global_stats);
+	fprintf(f, ",\n\"total\":");
+	stats_json(f, "total", "", &total);
+	fprintf(f, "\n}\n");
+
+	if (f != stdout && fclose(f)) {
+		int ret = -errno;
+		error("could not write stats file %s: %s\n", filename, strerror(errno));
+		return ret;
+	}
+
+	return 0;
+}
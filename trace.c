@@ -0,0 +1,154 @@
+/*
+ * Trace events in the Chrome trace event format
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The trace is written as a JSON array of complete ("X") events, so it can
+ * be loaded into chrome://tracing or Perfetto even if genimage exits
+ * before the array is closed.
+ */
+
+#include <confuse.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "genimage.h"
+
+static FILE *trace_file;
+static int trace_events;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * microseconds since the first call
+ */
+unsigned long long trace_now(void)
+{
+	static unsigned long long base;
+	struct timespec ts;
+	unsigned long long now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	if (!base)
+		base = now;
+
+	return now - base;
+}
+
+int trace_enabled(void)
+{
+	return trace_file != NULL;
+}
+
+int trace_init(const char *filename)
+{
+	if (trace_file || !filename || !*filename)
+		return 0;
+
+	trace_file = fopen(filename, "w");
+	if (!trace_file) {
+		int ret = -errno;
+		error("could not open trace file %s: %s\n", filename, strerror(errno));
+		return ret;
+	}
+	fprintf(trace_file, "[\n");
+
+	return 0;
+}
+
+void trace_close(void)
+{
+	if (!trace_file)
+		return;
+
+	fprintf(trace_file, "\n]\n");
+	fclose(trace_file);
+	trace_file = NULL;
+}
+
+/*
+ * return @str as a quoted and escaped JSON string
+ */
+char *json_string(const char *str)
+{
+	char *buf, *p;
+
+	if (!str)
+		return strcpy(xzalloc(sizeof("null")), "null");
+
+	buf = xzalloc(strlen(str) * 6 + 3);
+	p = buf;
+
+	*p++ = '"';
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\') {
+			*p++ = '\\';
+			*p++ = c;
+		} else if (c < 0x20) {
+			p += sprintf(p, "\\u%04x", c);
+		} else {
+			*p++ = c;
+		}
+	}
+	*p++ = '"';
+
+	return buf;
+}
+
+/*
+ * Add a span that started at @start (from trace_now()) and ends now.
+ * @fmt is optional and describes the members of the "args" object.
+ */
+void trace_span(unsigned long long start, const char *cat, const char *name,
+		const char *fmt, ...)
+{
+	unsigned long long end;
+	char *args = NULL, *jname;
+	va_list ap;
+
+	if (!trace_file)
+		return;
+
+	end = trace_now();
+
+	if (fmt) {
+		va_start(ap, fmt);
+		if (vasprintf(&args, fmt, ap) < 0)
+			args = NULL;
+		va_end(ap);
+	}
+	jname = json_string(name);
+
+	pthread_mutex_lock(&trace_lock);
+	fprintf(trace_file,
+		"%s{\"name\":%s,\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+		"\"pid\":%d,\"tid\":%ld%s%s%s}",
+		trace_events++ ? ",\n" : "", jname, cat, start, end - start,
+		(int)getpid(), (long)syscall(SYS_gettid),
+		args ? ",\"args\":{" : "", args ?: "", args ? "}" : "");
+	pthread_mutex_unlock(&trace_lock);
+
+	free(jname);
+	free(args);
+}
@@ -0,0 +1,458 @@
+/*
+ * Asynchronous copy and fill with io_uring
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The ring is used with the raw system calls, so liburing is not needed.
+ * Each ring has a set of registered buffers. A copy keeps a read or a
+ * write in flight for every buffer: when a read completes, the data is
+ * written from the same buffer and when the write completes, the buffer
+ * is used for the next read.
+ */
+
+#include <confuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "genimage.h"
+
+static cfg_bool_t uring_disabled;
+
+/*
+ * Check the 'io-uring' option once at startup, so that an invalid value
+ * fails before any image is generated.
+ */
+int uring_init(const char *mode)
+{
+	if (!mode || !*mode || !strcmp(mode, "auto"))
+		return 0;
+	if (!strcmp(mode, "no")) {
+		uring_disabled = cfg_true;
+		return 0;
+	}
+
+	error("invalid io-uring mode '%s'\n", mode);
+	return -EINVAL;
+}
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+#define URING_BUF_SIZE (1024 * 1024)
+#define URING_BUFS 8
+
+struct uring {
+	int fd;
+	char *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned pending;
+	/* requests may still be in flight after an error, never reuse it */
+	int broken;
+	unsigned nbufs;
+	struct iovec bufs[URING_BUFS];
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			      unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+				 unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+void uring_close(struct uring *ring)
+{
+	unsigned i;
+
+	if (!ring)
+		return;
+
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	for (i = 0; i < ring->nbufs; i++)
+		free(ring->bufs[i].iov_base);
+	free(ring);
+}
+
+/*
+ * Set up a ring with registered buffers. Returns NULL if io_uring is not
+ * available, e.g. because the kernel is too old or the system calls are
+ * blocked. The callers then fall back to synchronous I/O.
+ */
+struct uring *uring_open(void)
+{
+	struct io_uring_params p = { 0 };
+	struct uring *ring;
+	unsigned i;
+	int ret;
+
+	if (uring_disabled)
+		return NULL;
+
+	ring = xzalloc(sizeof(*ring));
+	ring->fd = sys_io_uring_setup(URING_BUFS, &p);
+	if (ring->fd < 0) {
+		debug("io_uring_setup: %s\n", strerror(errno));
+		goto err;
+	}
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			goto err;
+		}
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->sq_head = (void *)(ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (void *)(ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (void *)(ring->sq_ptr + p.sq_off.ring_mask);
+	ring->sq_array = (void *)(ring->sq_ptr + p.sq_off.array);
+	ring->cq_head = (void *)(ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (void *)(ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (void *)(ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (void *)(ring->cq_ptr + p.cq_off.cqes);
+
+	for (i = 0; i < URING_BUFS; i++) {
+		if (posix_memalign(&ring->bufs[i].iov_base, 4096, URING_BUF_SIZE))
+			goto err;
+		ring->bufs[i].iov_len = URING_BUF_SIZE;
+		ring->nbufs++;
+	}
+	/* the registered buffers count against RLIMIT_MEMLOCK, so try fewer */
+	while (ring->nbufs) {
+		ret = sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS,
+					    ring->bufs, ring->nbufs);
+		if (ret == 0)
+			break;
+		if (errno != ENOMEM || ring->nbufs <= 2) {
+			debug("io_uring_register: %s\n", strerror(errno));
+			goto err;
+		}
+		ring->nbufs /= 2;
+	}
+
+	return ring;
+err:
+	uring_close(ring);
+	return NULL;
+}
+
+static void uring_prep(struct uring *ring, int op, int fd, unsigned buf,
+		       unsigned len, unsigned long long offset,
+		       unsigned long long data)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)ring->bufs[buf].iov_base;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->buf_index = buf;
+	sqe->user_data = data;
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+}
+
+/*
+ * Submit all prepared requests and wait for at least one completion.
+ */
+static int uring_wait(struct uring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned head = *ring->cq_head;
+	int ret;
+
+	while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		ret = sys_io_uring_enter(ring->fd, ring->pending, 1,
+					 IORING_ENTER_GETEVENTS);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		ring->pending -= ret;
+	}
+	*cqe = ring->cqes[head & *ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Wait for the @inflight requests that are left after uring_wait() failed,
+ * so that no stale completion is seen by the next copy or fill.
+ */
+static int uring_drain(struct uring *ring, unsigned inflight, int err)
+{
+	struct io_uring_cqe cqe;
+
+	while (inflight) {
+		if (uring_wait(ring, &cqe)) {
+			ring->broken = 1;
+			break;
+		}
+		inflight--;
+	}
+
+	return err;
+}
+
+#define URING_WRITE (1ULL << 63)
+
+/*
+ * Copy @len bytes from @in at @in_pos to @out at @offset. Returns the
+ * number of bytes copied, which is less than @len only at the end of @in,
+ * or a negative error code.
+ */
+long long uring_copy(struct uring *ring, int in, int out,
+		     unsigned long long in_pos, unsigned long long offset,
+		     unsigned long long len, struct io_stats *io)
+{
+	/* input position and length of the data in each buffer */
+	unsigned long long pos[URING_BUFS];
+	unsigned buflen[URING_BUFS];
+	unsigned long long next = 0, done = 0;
+	unsigned inflight = 0, i;
+	int eof = 0, ret = 0;
+
+	if (ring->broken)
+		return -EIO;
+
+	for (i = 0; i < ring->nbufs && next < len; i++) {
+		pos[i] = next;
+		buflen[i] = min(len - next, URING_BUF_SIZE);
+		uring_prep(ring, IORING_OP_READ_FIXED, in, i, buflen[i],
+			   in_pos + next, i);
+		next += buflen[i];
+		inflight++;
+	}
+
+	while (inflight) {
+		struct io_uring_cqe cqe;
+		unsigned long long data;
+		int err;
+
+		err = uring_wait(ring, &cqe);
+		if (err)
+			return uring_drain(ring, inflight, err);
+		inflight--;
+		data = cqe.user_data;
+		i = data & ~URING_WRITE;
+
+		if (cqe.res < 0) {
+			/* let the remaining requests complete first */
+			ret = cqe.res;
+			continue;
+		}
+		if (ret)
+			continue;
+
+		if (!(data & URING_WRITE)) {
+			io->read += cqe.res;
+			if ((unsigned)cqe.res < buflen[i]) {
+				/* the input ended early, stop reading */
+				eof = 1;
+				len = min(len, pos[i] + cqe.res);
+			}
+			buflen[i] = pos[i] < len ? min(buflen[i], len - pos[i]) : 0;
+			if (!buflen[i])
+				continue;
+			uring_prep(ring, IORING_OP_WRITE_FIXED, out, i,
+				   buflen[i], offset + pos[i], i | URING_WRITE);
+			inflight++;
+			continue;
+		}
+
+		if (!cqe.res) {
+			ret = -EIO;
+			continue;
+		}
+		io->writes++;
+		io->written += cqe.res;
+		done += cqe.res;
+		if ((unsigned)cqe.res < buflen[i]) {
+			/* short write: write the rest from the same buffer */
+			memmove(ring->bufs[i].iov_base,
+				(char *)ring->bufs[i].iov_base + cqe.res,
+				buflen[i] - cqe.res);
+			pos[i] += cqe.res;
+			buflen[i] -= cqe.res;
+			uring_prep(ring, IORING_OP_WRITE_FIXED, out, i,
+				   buflen[i], offset + pos[i], i | URING_WRITE);
+			inflight++;
+			continue;
+		}
+		if (eof || next >= len)
+			continue;
+		pos[i] = next;
+		buflen[i] = min(len - next, URING_BUF_SIZE);
+		uring_prep(ring, IORING_OP_READ_FIXED, in, i, buflen[i],
+			   in_pos + next, i);
+		next += buflen[i];
+		inflight++;
+	}
+
+	return ret ?: (long long)done;
+}
+
+/*
+ * Write @len @byte bytes at @offset to @fd. All writes use the first
+ * buffer, so as many writes as there are ring entries are in flight.
+ */
+int uring_fill(struct uring *ring, int fd, unsigned long long offset,
+	       unsigned long long len, unsigned char byte, struct io_stats *io)
+{
+	unsigned long long end = offset + len;
+	unsigned long long pos[URING_BUFS];
+	unsigned buflen[URING_BUFS];
+	unsigned inflight = 0, i;
+	int ret = 0;
+
+	if (ring->broken)
+		return -EIO;
+
+	memset(ring->bufs[0].iov_base, byte, URING_BUF_SIZE);
+
+	for (i = 0; i < URING_BUFS && offset < end; i++) {
+		pos[i] = offset;
+		buflen[i] = min(end - offset, URING_BUF_SIZE);
+		uring_prep(ring, IORING_OP_WRITE_FIXED, fd, 0, buflen[i], pos[i], i);
+		offset += buflen[i];
+		inflight++;
+	}
+
+	while (inflight) {
+		struct io_uring_cqe cqe;
+		int err;
+
+		err = uring_wait(ring, &cqe);
+		if (err)
+			return uring_drain(ring, inflight, err);
+		inflight--;
+		i = cqe.user_data;
+
+		if (cqe.res < 0) {
+			ret = cqe.res;
+			continue;
+		}
+		if (!cqe.res) {
+			ret = -EIO;
+			continue;
+		}
+		io->writes++;
+		io->written += cqe.res;
+		if (ret)
+			continue;
+		if ((unsigned)cqe.res < buflen[i]) {
+			pos[i] += cqe.res;
+			buflen[i] -= cqe.res;
+		} else if (offset < end) {
+			pos[i] = offset;
+			buflen[i] = min(end - offset, URING_BUF_SIZE);
+			offset += buflen[i];
+		} else {
+			continue;
+		}
+		uring_prep(ring, IORING_OP_WRITE_FIXED, fd, 0, buflen[i], pos[i], i);
+		inflight++;
+	}
+
+	return ret;
+}
+
+#else
+
+struct uring *uring_open(void)
+{
+	return NULL;
+}
+
+void uring_close(struct uring *ring)
+{
+}
+
+long long uring_copy(struct uring *ring, int in, int out,
+		     unsigned long long in_pos, unsigned long long offset,
+		     unsigned long long len, struct io_stats *io)
+{
+	return -EOPNOTSUPP;
+}
+
+int uring_fill(struct uring *ring, int fd, unsigned long long offset,
+	       unsigned long long len, unsigned char byte, struct io_stats *io)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif
@@ -16,14 +16,22 @@
  */
 
 #include <confuse.h>
+#include <endian.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <spawn.h>
+#include <wordexp.h>
 #ifdef HAVE_LINUX_FS_H
 #include <linux/fs.h>
 #endif
@@ -206,19 +214,219 @@ void debug(const char *fmt, ...)
 	va_end(args);
 }
 
+/*
+ * Close a file written for @image. With --sync=always, the file is synced
+ * first, unless @image is temporary.
+ */
 static int fsync_close(struct image *image, int fd)
 {
-	int a, b;
+	int a = 0, b;
 
-	a = fsync(fd);
-	if (a)
-		image_error(image, "fsync() failed: %s\n", strerror(errno));
+	if (get_sync_mode() == SYNC_ALWAYS && !(image && image->temporary)) {
+		struct io_stats io = { .fsyncs = 1 };
+		unsigned long long start = trace_now();
+
+		a = fsync(fd);
+		io.fsync_us = trace_now() - start;
+		stats_add_io(image, &io);
+		if (a)
+			image_error(image, "fsync() failed: %s\n", strerror(errno));
+	}
 	b = close(fd);
 	if (b)
 		image_error(image, "close() failed: %s\n", strerror(errno));
 	return (a || b) ? -1 : 0;
 }
 
+/*
+ * With --sync=final, sync the output of @image once it is complete.
+ */
+int sync_image(struct image *image)
+{
+	struct io_stats io = { .fsyncs = 1 };
+	unsigned long long start;
+	int fd, ret = 0;
+
+	if (get_sync_mode() != SYNC_FINAL || image->temporary)
+		return 0;
+
+	fd = open(imageoutfile(image), O_RDONLY);
+	if (fd < 0) {
+		/* images with a size of 0 are removed */
+		if (errno == ENOENT)
+			return 0;
+		ret = -errno;
+		image_error(image, "open %s: %s\n", imageoutfile(image), strerror(errno));
+		return ret;
+	}
+	start = trace_now();
+	if (fdatasync(fd)) {
+		ret = -errno;
+		image_error(image, "fdatasync() failed: %s\n", strerror(errno));
+	}
+	io.fsync_us = trace_now() - start;
+	stats_add_io(image, &io);
+	close(fd);
+
+	return ret;
+}
+
+static void read_pipe(int fd, char **buf, size_t *len)
+{
+	char tmp[4096];
+	ssize_t r;
+
+	r = read(fd, tmp, sizeof(tmp));
+	if (r <= 0)
+		return;
+	*buf = xrealloc(*buf, *len + r + 1);
+	memcpy(*buf + *len, tmp, r);
+	*len += r;
+	(*buf)[*len] = '\0';
+}
+
+/*
+ * Run @argv with posix_spawn(). Without @out/@err, stdout and stderr of
+ * the command are handled according to the loglevel. Otherwise they are
+ * captured into newly allocated, zero terminated buffers.
+ */
+static int spawn(struct image *image, const char *cmd, char *const argv[],
+		 char **out, char **err)
+{
+	unsigned long long start = trace_now();
+	struct rusage ru;
+	char *jcmd;
+	posix_spawn_file_actions_t actions;
+	int out_pipe[2] = { -1, -1 }, err_pipe[2] = { -1, -1 };
+	size_t out_len = 0, err_len = 0;
+	int ret, status;
+	pid_t pid;
+
+	if (out)
+		*out = xzalloc(1);
+	if (err)
+		*err = xzalloc(1);
+
+	if ((out && pipe2(out_pipe, O_CLOEXEC)) ||
+	    (err && pipe2(err_pipe, O_CLOEXEC))) {
+		ret = -errno;
+		error("Failed to create pipe: %s\n", strerror(errno));
+		goto out;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	if (err)
+		posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+	else if (loglevel() < 1)
+		posix_spawn_file_actions_addopen(&actions, STDERR_FILENO,
+						 "/dev/null", O_WRONLY, 0);
+	if (out)
+		posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+	else if (loglevel() < 3)
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+						 "/dev/null", O_WRONLY, 0);
+	else
+		posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+
+	ret = posix_spawnp(&pid, argv[0], &actions, NULL, argv,
+			   image && image->env ? image->env : environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (ret) {
+		error("Cannot execute %s: %s\n", argv[0], strerror(ret));
+		ret = -ret;
+		goto out;
+	}
+
+	if (out) {
+		close(out_pipe[1]);
+		out_pipe[1] = -1;
+	}
+	if (err) {
+		close(err_pipe[1]);
+		err_pipe[1] = -1;
+	}
+	while (out_pipe[0] >= 0 || err_pipe[0] >= 0) {
+		struct pollfd fds[2] = {
+			{ .fd = out_pipe[0], .events = POLLIN },
+			{ .fd = err_pipe[0], .events = POLLIN },
+		};
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].revents) {
+			read_pipe(out_pipe[0], out, &out_len);
+			if (!(fds[0].revents & POLLIN)) {
+				close(out_pipe[0]);
+				out_pipe[0] = -1;
+			}
+		}
+		if (fds[1].revents) {
+			read_pipe(err_pipe[0], err, &err_len);
+			if (!(fds[1].revents & POLLIN)) {
+				close(err_pipe[0]);
+				err_pipe[0] = -1;
+			}
+		}
+	}
+
+	ret = wait4(pid, &status, 0, &ru);
+	if (ret < 0) {
+		ret = -errno;
+		error("Failed to wait for command execution: %s\n", strerror(errno));
+		goto out;
+	}
+
+	/* like the shell: report commands killed by a signal as 128+n */
+	if (WIFSIGNALED(status))
+		ret = 128 + WTERMSIG(status);
+	else
+		ret = WEXITSTATUS(status);
+
+	stats_add_cmd(image, &ru, trace_now() - start);
+	image_debug(image, "cmd: user %ld.%06lds sys %ld.%06lds maxrss %ldkB in %ld out %ld blocks\n",
+		    (long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec,
+		    (long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec,
+		    ru.ru_maxrss, ru.ru_inblock, ru.ru_oublock);
+
+	if (trace_enabled()) {
+		char *name = strndupa(cmd, strcspn(cmd, " "));
+
+		jcmd = json_string(cmd);
+		trace_span(start, "cmd", name,
+			   "\"cmd\":%s,\"status\":%d,\"utime_us\":%llu,\"stime_us\":%llu,"
+			   "\"maxrss_kb\":%ld,\"inblock\":%ld,\"oublock\":%ld",
+			   jcmd, ret,
+			   ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec,
+			   ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec,
+			   ru.ru_maxrss, ru.ru_inblock, ru.ru_oublock);
+		free(jcmd);
+	}
+out:
+	if (out_pipe[0] >= 0)
+		close(out_pipe[0]);
+	if (out_pipe[1] >= 0)
+		close(out_pipe[1]);
+	if (err_pipe[0] >= 0)
+		close(err_pipe[0]);
+	if (err_pipe[1] >= 0)
+		close(err_pipe[1]);
+
+	return ret;
+}
+
+static const char *cmd_output(void)
+{
+	if (loglevel() >= 3)
+		return " (stderr+stdout):";
+	else if (loglevel() >= 1)
+		return " (stderr):";
+	else
+		return "";
+}
+
 /*
  * printf wrapper around 'system'
  */
@@ -226,10 +434,8 @@ int systemp(struct image *image, const char *fmt, ...)
 {
 	va_list args;
 	char *buf;
-	const char *o;
+	const char *shell;
 	int ret;
-	int status;
-	pid_t pid;
 
 	va_start(args, fmt);
 
@@ -240,54 +446,97 @@ int systemp(struct image *image, const char *fmt, ...)
 	if (!buf)
 		return -ENOMEM;
 
-	if (loglevel() >= 3)
-		o = " (stderr+stdout):";
-	else if (loglevel() >= 1)
-		o = " (stderr):";
-	else
-		o = "";
+	image_info(image, "cmd: \"%s\"%s\n", buf, cmd_output());
 
-	image_info(image, "cmd: \"%s\"%s\n", buf, o);
+	shell = getenv("GENIMAGE_SHELL");
+	if (!shell || shell[0] == 0x0)
+		shell = "/bin/sh";
 
-	pid = fork();
+	ret = spawn(image, buf, (char *const[]){ (char *)shell, "-c", buf, NULL },
+		    NULL, NULL);
 
-	if (!pid) {
-		const char *shell;
-		int fd;
+	free(buf);
 
-		if (loglevel() < 1) {
-			fd = open("/dev/null", O_WRONLY);
-			dup2(fd, STDERR_FILENO);
-		}
+	return ret;
+}
 
-		if (loglevel() < 3) {
-			fd = open("/dev/null", O_WRONLY);
-			dup2(fd, STDOUT_FILENO);
-		} else {
-			dup2(STDERR_FILENO, STDOUT_FILENO);
+/*
+ * Run a command without a shell. @argv is a NULL terminated argument
+ * list, argv[0] is looked up in $PATH. argv[0] may also be a tool option
+ * that contains arguments or a wrapper command, such as "mcopy -v". It is
+ * split into words like the shell does. If @out or @err are not NULL, the
+ * stdout or stderr of the command is returned in a newly allocated
+ * buffer. Returns the exit code of the command like systemp().
+ */
+int spawnv(struct image *image, char *const argv[], char **out, char **err)
+{
+	char *const *args = argv;
+	char **words = NULL;
+	char *buf = NULL;
+	wordexp_t we;
+	int i, n, ret;
+
+	if (argv[0][strcspn(argv[0], " \t\n'\"\\$~")]) {
+		ret = wordexp(argv[0], &we, WRDE_NOCMD);
+		if (ret || !we.we_wordc) {
+			image_error(image, "invalid command '%s'\n", argv[0]);
+			if (!ret)
+				wordfree(&we);
+			return -EINVAL;
 		}
+		for (n = 1; argv[n]; n++)
+			;
+		words = xzalloc((we.we_wordc + n) * sizeof(*words));
+		memcpy(words, we.we_wordv, we.we_wordc * sizeof(*words));
+		memcpy(words + we.we_wordc, argv + 1, n * sizeof(*words));
+		args = words;
+	}
 
-		shell = getenv("GENIMAGE_SHELL");
-		if (!shell || shell[0] == 0x0)
-			shell = "/bin/sh";
+	for (i = 0; args[i]; i++) {
+		const char *arg = args[i];
 
-		execl(shell, shell, "-c", buf, NULL);
-		ret = -errno;
-		error("Cannot execute %s: %s\n", buf, strerror(errno));
-		goto err_out;
-	} else {
-		ret = waitpid(pid, &status, 0);
-		if (ret < 0) {
-			ret = -errno;
-			error("Failed to wait for command execution: %s\n", strerror(errno));
-			goto err_out;
-		}
+		/* quote the arguments like in the shell for the log */
+		if (*arg && !arg[strcspn(arg, " \t\n'\"\\$`*?[]{}()<>|&;#~")])
+			xstrcatf(&buf, "%s%s", i ? " " : "", arg);
+		else
+			xstrcatf(&buf, "%s'%s'", i ? " " : "", arg);
 	}
+	image_info(image, "cmd: \"%s\"%s\n", buf, out || err ? "" : cmd_output());
 
-	ret = WEXITSTATUS(status);
-
-err_out:
+	ret = spawn(image, buf, args, out, err);
 	free(buf);
+	if (words) {
+		free(words);
+		wordfree(&we);
+	}
+
+	return ret;
+}
+
+/*
+ * Like spawnv() with the arguments as a NULL terminated list and without
+ * capturing the output.
+ */
+int spawnl(struct image *image, const char *arg, ...)
+{
+	const char **argv;
+	va_list args;
+	int argc = 1, ret;
+
+	va_start(args, arg);
+	while (va_arg(args, const char *))
+		argc++;
+	va_end(args);
+
+	argv = xzalloc((argc + 1) * sizeof(*argv));
+	argv[0] = arg;
+	va_start(args, arg);
+	for (argc = 1; (argv[argc] = va_arg(args, const char *)); argc++)
+		;
+	va_end(args);
+
+	ret = spawnv(image, (char *const *)argv, NULL, NULL);
+	free(argv);
 
 	return ret;
 }
@@ -397,155 +646,687 @@ int open_file(struct image *image, const char *filename, int extra_flags)
 	return fd;
 }
 
-/* Build a file extent covering the whole file */
-int whole_file_exent(size_t size, struct extent **extents,
-		     size_t *extent_count)
+/* number of extents that are requested from FIEMAP at once */
+#define EXTENT_BATCH 128
+
+enum extent_mode {
+	EXTENT_FIEMAP,
+	EXTENT_SEEK,
+	EXTENT_WHOLE,
+	EXTENT_DONE,
+};
+
+/*
+ * Iterate over the data extents of @fd in the range [@start, @size).
+ * FIEMAP is used if possible. It is queried in batches of EXTENT_BATCH
+ * extents, so the memory used does not depend on the fragmentation of the
+ * file. If FIEMAP is not supported or if the file has unwritten extents,
+ * that read as zeros but are reported as data by FIEMAP, SEEK_DATA and
+ * SEEK_HOLE are used for the rest of the file instead. If neither works,
+ * the rest of the file is one extent.
+ */
+void extent_iter_init(struct extent_iter *it, struct image *image,
+		      const char *filename, int fd,
+		      unsigned long long start, unsigned long long size)
 {
-	*extents = xzalloc(sizeof(struct extent));
-	(*extents)[0].start = 0;
-	(*extents)[0].end = size;
-	*extent_count = 1;
-	return 0;
+	memset(it, 0, sizeof(*it));
+	it->image = image;
+	it->filename = filename;
+	it->fd = fd;
+	it->pos = start;
+	it->size = size;
+#ifdef HAVE_FIEMAP
+	it->mode = EXTENT_FIEMAP;
+	it->fiemap = xzalloc(sizeof(struct fiemap) +
+			     EXTENT_BATCH * sizeof(struct fiemap_extent));
+#else
+	it->mode = EXTENT_SEEK;
+#endif
 }
 
-/* Build an file extent array for the file */
-int map_file_extents(struct image *image, const char *filename, int f,
-		     size_t size, struct extent **extents, size_t *extent_count)
+/* Iterate over the whole file as one extent */
+void extent_iter_init_whole(struct extent_iter *it, unsigned long long size)
 {
-	int ret;
+	memset(it, 0, sizeof(*it));
+	it->fd = -1;
+	it->size = size;
+	it->mode = EXTENT_WHOLE;
+}
+
 #ifdef HAVE_FIEMAP
-	struct fiemap *fiemap;
+/*
+ * Returns 1 if the next batch was read, 0 if there are no more extents
+ * and -EAGAIN if another method must be used from it->pos on.
+ */
+static int extent_iter_fiemap(struct extent_iter *it)
+{
+	struct fiemap *fiemap = it->fiemap;
 	unsigned i;
+	int ret;
 
-	/* Get extent count */
-	fiemap = xzalloc(sizeof(struct fiemap));
-	fiemap->fm_length = size;
-	ret = ioctl(f, FS_IOC_FIEMAP, fiemap);
-	if (ret == -1)
-		goto err_out;
+	if (it->last)
+		return 0;
 
-	/* Get extents */
-	fiemap = xrealloc(fiemap, sizeof(struct fiemap) + fiemap->fm_mapped_extents * sizeof(struct fiemap_extent));
-	fiemap->fm_extent_count = fiemap->fm_mapped_extents;
-	ret = ioctl(f, FS_IOC_FIEMAP, fiemap);
-	if (ret == -1)
-		goto err_out;
+	memset(fiemap, 0, sizeof(*fiemap));
+	fiemap->fm_start = it->pos;
+	fiemap->fm_length = it->size - it->pos;
+	fiemap->fm_extent_count = EXTENT_BATCH;
+	if (ioctl(it->fd, FS_IOC_FIEMAP, fiemap) == -1) {
+		ret = -errno;
+		/* only fall back if nothing was mapped yet */
+		if (!it->mapped && (ret == -EOPNOTSUPP || ret == -ENOTTY))
+			return -EAGAIN;
+		image_error(it->image, "fiemap %s: %d %s\n", it->filename,
+			    -ret, strerror(-ret));
+		return ret;
+	}
+	it->mapped = 1;
+	if (!fiemap->fm_mapped_extents)
+		return 0;
 
-	/* Build extent array */
-	*extent_count = fiemap->fm_mapped_extents;
-	*extents = xzalloc(*extent_count * sizeof(struct extent));
-	for (i = 0; i < *extent_count; i++) {
-		(*extents)[i].start = fiemap->fm_extents[i].fe_logical;
-		(*extents)[i].end = fiemap->fm_extents[i].fe_logical + fiemap->fm_extents[i].fe_length;
+	for (i = 0; i < fiemap->fm_mapped_extents; i++) {
+		if (fiemap->fm_extents[i].fe_flags & FIEMAP_EXTENT_UNWRITTEN) {
+			/* use SEEK_DATA/SEEK_HOLE from the first unwritten extent on */
+			if (!i)
+				return -EAGAIN;
+			fiemap->fm_mapped_extents = i;
+			it->fallback = 1;
+			break;
+		}
+		if (fiemap->fm_extents[i].fe_flags & FIEMAP_EXTENT_LAST)
+			it->last = 1;
 	}
+	it->idx = 0;
 
-	/* The last extent may extend beyond the end of file, limit it to the actual end */
-	if (*extent_count && (*extents)[i - 1].end > size)
-		(*extents)[i - 1].end = size;
+	return 1;
+}
+#endif
 
-	free(fiemap);
+/*
+ * Store the next extent in @ext. Returns 1 if there is one, 0 at the end
+ * of the file and a negative error code otherwise.
+ */
+int extent_iter_next(struct extent_iter *it, struct extent *ext)
+{
+	off_t data, hole;
+	int ret;
 
+	while (it->pos < it->size) {
+		switch (it->mode) {
+#ifdef HAVE_FIEMAP
+		case EXTENT_FIEMAP: {
+			struct fiemap_extent *fe;
+
+			if (it->idx >= it->fiemap->fm_mapped_extents) {
+				if (it->fallback) {
+					it->mode = EXTENT_SEEK;
+					continue;
+				}
+				ret = extent_iter_fiemap(it);
+				if (ret == -EAGAIN) {
+					it->mode = EXTENT_SEEK;
+					continue;
+				}
+				if (ret <= 0) {
+					it->mode = EXTENT_DONE;
+					return ret;
+				}
+			}
+			fe = &it->fiemap->fm_extents[it->idx++];
+			ext->start = fe->fe_logical < it->pos ? it->pos : fe->fe_logical;
+			ext->end = min(fe->fe_logical + fe->fe_length, it->size);
+			if (ext->start >= ext->end)
+				continue;
+			it->pos = ext->end;
+			return 1;
+		}
+#endif
+		case EXTENT_SEEK:
+			data = lseek(it->fd, it->pos, SEEK_DATA);
+			if (data < 0) {
+				/* no more data after pos */
+				if (errno == ENXIO)
+					break;
+				goto seek_err;
+			}
+			if ((unsigned long long)data >= it->size)
+				break;
+			hole = lseek(it->fd, data, SEEK_HOLE);
+			if (hole < 0)
+				goto seek_err;
+			ext->start = data;
+			ext->end = min((unsigned long long)hole, it->size);
+			it->pos = ext->end;
+			return 1;
+		case EXTENT_WHOLE:
+			ext->start = it->pos;
+			ext->end = it->size;
+			it->pos = it->size;
+			return 1;
+		default:
+			break;
+		}
+		break;
+	}
+	it->mode = EXTENT_DONE;
 	return 0;
 
-err_out:
+seek_err:
 	ret = -errno;
+	/* If failure is due to no filesystem support, use a single extent */
+	if (ret == -EINVAL || ret == -EOPNOTSUPP) {
+		it->mode = EXTENT_WHOLE;
+		return extent_iter_next(it, ext);
+	}
+	image_error(it->image, "seek %s: %s\n", it->filename, strerror(-ret));
+	it->mode = EXTENT_DONE;
+	return ret;
+}
 
-	free(fiemap);
-#else
-	ret = -EOPNOTSUPP;
+void extent_iter_free(struct extent_iter *it)
+{
+	free(it->fiemap);
+	it->fiemap = NULL;
+}
+
+/* amount of data that is read or written before it is dropped from the cache */
+#define STREAM_WINDOW (16 * 1024 * 1024)
+
+/*
+ * With 'streaming = true', the page cache used for @fd is limited. Input
+ * files are read with POSIX_FADV_SEQUENTIAL and the data behind the cursor
+ * is dropped. For outputs, each window is written back with
+ * sync_file_range() while the next one is written and dropped once that is
+ * done, so at most two windows are dirty.
+ */
+void stream_open(struct stream *s, int fd, int output)
+{
+	memset(s, 0, sizeof(*s));
+	s->fd = get_streaming() ? fd : -1;
+	s->output = output;
+#ifdef HAVE_POSIX_FADVISE
+	if (s->fd >= 0 && !output)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
+}
 
-	/* If failure is due to no filesystem support, return a single extent */
-	if (ret == -EOPNOTSUPP || ret == -ENOTTY)
-		return whole_file_exent(size, extents, extent_count);
+static void stream_drop(struct stream *s, unsigned long long start,
+			unsigned long long end)
+{
+#ifdef HAVE_POSIX_FADVISE
+	if (end > start)
+		posix_fadvise(s->fd, start, end - start, POSIX_FADV_DONTNEED);
+#endif
+}
 
-	image_error(image, "fiemap %s: %d %s\n", filename, errno, strerror(errno));
-	return ret;
+static void stream_flush(struct stream *s, int wait)
+{
+	if (!s->output) {
+		stream_drop(s, s->start, s->end);
+		s->start = s->end;
+		return;
+	}
+#ifdef HAVE_SYNC_FILE_RANGE
+	if (s->end > s->start)
+		sync_file_range(s->fd, s->start, s->end - s->start,
+				SYNC_FILE_RANGE_WRITE);
+	/* pages can only be dropped once they are clean */
+	if (s->wb_end > s->wb_start) {
+		sync_file_range(s->fd, s->wb_start, s->wb_end - s->wb_start,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		stream_drop(s, s->wb_start, s->wb_end);
+	}
+	s->wb_start = s->start;
+	s->wb_end = s->end;
+	if (wait)
+		stream_flush(s, 0);
+#endif
+	s->start = s->end;
 }
 
 /*
- * Write @size @byte bytes at the @offset in @fd. Roughly equivalent to
- * a single "pwrite(fd, big-buffer, size, offset)", except that we try to use
- * more efficient operations (ftruncate and fallocate) if @byte is zero. This
- * only uses methods that do not affect the offset of fd.
+ * Continue reading or writing at @pos.
  */
-static int write_bytes(int fd, size_t size, off_t offset, unsigned char byte, cfg_bool_t sparse)
+void stream_seek(struct stream *s, unsigned long long pos)
 {
-	struct stat st;
-	char buf[4096];
+	if (s->fd < 0 || pos == s->end)
+		return;
+	stream_flush(s, 0);
+	s->start = s->end = pos;
+}
 
-	if (!size)
-		return 0;
+/*
+ * Everything up to @pos was read or written.
+ */
+void stream_advance(struct stream *s, unsigned long long pos)
+{
+	if (s->fd < 0 || pos <= s->end)
+		return;
+	s->end = pos;
+	if (s->end - s->start >= STREAM_WINDOW)
+		stream_flush(s, 0);
+}
 
-	if (fstat(fd, &st) < 0)
-		return -errno;
+void stream_close(struct stream *s)
+{
+	if (s->fd < 0)
+		return;
+	stream_flush(s, 1);
+	s->fd = -1;
+}
 
-	if (S_ISREG(st.st_mode) && (byte == 0) && sparse) {
-		if (offset + size > (size_t)st.st_size) {
-			if (ftruncate(fd, offset + size) < 0)
-				return -errno;
-			/*
-			 * The area from st.st_size to offset+size is
-			 * zeroed by this operation. If offset was >=
-			 * st.st_size, we're done.
-			 */
-			if (offset >= st.st_size)
-				return 0;
-			/*
-			 * Otherwise, reduce size accordingly, we only
-			 * need to write bytes from offset until the
-			 * old end of the file.
-			 */
-			size = st.st_size - offset;
-		}
-#ifdef HAVE_FALLOCATE
-		/*
-		 * Use fallocate if it is available and FALLOC_FL_PUNCH_HOLE
-		 * is supported by the filesystem. If not, fall through to
-		 * the write loop.
-		 */
-		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-			      offset, size) == 0)
-			return 0;
-#endif
+/* state of the copies to one output file */
+struct copy_state {
+	const char *infile;
+	int in, out;
+	/* the output block device opened with O_DIRECT or -1 */
+	int direct;
+	/* logical block size of the output block device */
+	unsigned int sector;
+	/* only write the blocks that differ from the block device */
+	enum skip_unchanged skip_unchanged;
+	/* aligned buffer for the data read from the block device */
+	char *cmp_buf;
+	struct image *image;
+	unsigned long long in_size;
+	/* 0 if the data cannot be shared with FICLONERANGE */
+	unsigned long blksize;
+	int no_copy_range;
+	cfg_bool_t sparse;
+	/* do not write blocks of zeros from the input */
+	cfg_bool_t detect_zeros;
+	struct uring *ring;
+	int no_uring;
+	struct stream in_stream, out_stream;
+	struct io_stats io;
+};
+
+/* io_uring is only worth setting up for larger amounts of data */
+#define URING_MIN_SIZE (256 * 1024)
+
+static struct uring *copy_ring(struct copy_state *cs, unsigned long long len)
+{
+	if (len < URING_MIN_SIZE || cs->no_uring)
+		return NULL;
+	if (!cs->ring) {
+		cs->ring = uring_open();
+		cs->no_uring = !cs->ring;
 	}
+	return cs->ring;
+}
 
-	/* Not a regular file, non-zero pattern, or fallocate not applicable. */
-	memset(buf, byte, sizeof(buf));
+#define FILL_BUF_SIZE (1024 * 1024)
+
+/*
+ * Write @size @byte bytes at @offset to @fd, which is @cs->out or
+ * @cs->direct, with io_uring or with a large aligned buffer.
+ */
+static int fill_bytes(struct copy_state *cs, int fd, unsigned long long size,
+		      unsigned long long offset, unsigned char byte)
+{
+	struct uring *ring;
+	size_t bufsize = min(size, FILL_BUF_SIZE);
+	void *buf;
+	int ret = 0;
+
+	if (!size)
+		return 0;
+
+	ring = copy_ring(cs, size);
+	if (ring)
+		return uring_fill(ring, fd, offset, size, byte, &cs->io);
+
+	if (posix_memalign(&buf, 4096, bufsize))
+		return -ENOMEM;
+	memset(buf, byte, bufsize);
 	while (size) {
-		size_t now = min(size, sizeof(buf));
-		int r;
+		size_t now = min(size, bufsize);
+		ssize_t r;
 
 		r = pwrite(fd, buf, now, offset);
-		if (r < 0)
-			return -errno;
+		if (r <= 0) {
+			ret = r < 0 ? -errno : -EIO;
+			break;
+		}
+		cs->io.writes++;
+		cs->io.written += r;
 		size -= r;
 		offset += r;
 	}
-	return 0;
+	free(buf);
+
+	return ret;
 }
 
+/* cloning only pays off for larger ranges */
+#define FILL_CLONE_MIN (4 * FILL_BUF_SIZE)
+#define FILL_CLONE_MAX (256 * 1024 * 1024ULL)
+
 /*
- * For regular files this makes sure that:
- * - the file exists
- * - the file has the specified size
- * - any previous date is cleared
- * For block devices this makes sure that:
- * - any existing filesystem header is cleared
+ * Fill a large range in a file on a reflink capable filesystem: only the
+ * first FILL_BUF_SIZE bytes after the first block boundary are written.
+ * The rest is shared with FICLONERANGE, doubling the cloned range each
+ * time, so the data takes the space of a single buffer. Falls back to
+ * fill_bytes() if the filesystem does not support this.
  */
-int prepare_image(struct image *image, unsigned long long size)
+static int fill_clone(struct copy_state *cs, unsigned long long size,
+		      unsigned long long offset, unsigned char byte)
 {
+#ifdef FICLONERANGE
+	unsigned long long end = offset + size, src, done;
 	int ret;
 
-	if (is_block_device(imageoutfile(image))) {
-		insert_image(image, NULL, 2048, 0, 0, 0, cfg_false);
-	} else if (size == 0) {
-		ret = unlink(imageoutfile(image));
-		if (ret < 0 && errno != ENOENT) {
-			ret = -errno;
-			image_error(image, "failed to remove %s: %s\n",
-				    imageoutfile(image), strerror(-ret));
-			return ret;
+	if (!cs->blksize || FILL_BUF_SIZE % cs->blksize || size < FILL_CLONE_MIN)
+		return fill_bytes(cs, cs->out, size, offset, byte);
+
+	/* the head up to the block boundary and the template */
+	src = roundup(offset, cs->blksize);
+	done = FILL_BUF_SIZE;
+	ret = fill_bytes(cs, cs->out, src + done - offset, offset, byte);
+	if (ret)
+		return ret;
+
+	while (src + done < end) {
+		struct file_clone_range range = {
+			.src_fd = cs->out,
+			.src_offset = src,
+			.dest_offset = src + done,
+		};
+
+		range.src_length = rounddown(min(end - range.dest_offset, done),
+					     cs->blksize);
+		range.src_length = min(range.src_length, FILL_CLONE_MAX);
+		if (!range.src_length)
+			break;
+		if (ioctl(cs->out, FICLONERANGE, &range) < 0) {
+			cs->blksize = 0;
+			break;
+		}
+		cs->io.cloned += range.src_length;
+		done += range.src_length;
+	}
+
+	/* the tail after the last block or everything if cloning failed */
+	return fill_bytes(cs, cs->out, end - src - done, src + done, byte);
+#else
+	return fill_bytes(cs, cs->out, size, offset, byte);
+#endif
+}
+
+#define COMPARE_BLOCK_SIZE 4096
+#define COMPARE_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Write @len bytes of @data to the block device at @offset, skipping the
+ * blocks that already contain the same data. @offset and @len must be
+ * aligned to the logical block size and @len must not be larger than
+ * COMPARE_CHUNK_SIZE. With 'skip-unchanged = verify', the chunk is read
+ * back after writing it.
+ */
+static int write_changed(struct copy_state *cs, const char *data, size_t len,
+			 unsigned long long offset)
+{
+	size_t bs = cs->sector > COMPARE_BLOCK_SIZE ? cs->sector : COMPARE_BLOCK_SIZE;
+	char *old = cs->cmp_buf;
+	int changed = 0;
+	size_t pos, end;
+	ssize_t r;
+
+	if (!old) {
+		if (posix_memalign((void **)&cs->cmp_buf, 4096, COMPARE_CHUNK_SIZE))
+			return -ENOMEM;
+		old = cs->cmp_buf;
+	}
+
+	r = pread(cs->direct, old, len, offset);
+	if (r < 0) {
+		int ret = -errno;
+		image_error(cs->image, "reading %zu bytes at offset %llu failed: %s\n",
+			    len, offset, strerror(errno));
+		return ret;
+	}
+	cs->io.read += r;
+
+	/* handle runs of unchanged and changed blocks at once */
+	for (pos = 0; pos < len; pos = end) {
+		size_t n = min(len - pos, bs);
+		int same = pos + n <= (size_t)r && !memcmp(data + pos, old + pos, n);
+
+		for (end = pos + n; end < len; end += n) {
+			n = min(len - end, bs);
+			if ((end + n <= (size_t)r &&
+			     !memcmp(data + end, old + end, n)) != same)
+				break;
+		}
+
+		if (same) {
+			cs->io.unchanged += end - pos;
+			continue;
+		}
+		changed = 1;
+		while (pos < end) {
+			ssize_t w = pwrite(cs->direct, data + pos, end - pos, offset + pos);
+
+			if (w <= 0) {
+				int ret = w < 0 ? -errno : -EIO;
+				image_error(cs->image, "write %zu bytes: %s\n",
+					    end - pos, strerror(-ret));
+				return ret;
+			}
+			cs->io.writes++;
+			cs->io.written += w;
+			pos += w;
+		}
+	}
+
+	if (!changed || cs->skip_unchanged != SKIP_UNCHANGED_VERIFY)
+		return 0;
+
+	r = pread(cs->direct, old, len, offset);
+	if (r >= 0)
+		cs->io.read += r;
+	if (r != (ssize_t)len || memcmp(data, old, len)) {
+		image_error(cs->image, "verifying %zu bytes at offset %llu failed\n",
+			    len, offset);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Write aligned @data to the block device with O_DIRECT, through
+ * write_changed() with skip-unchanged.
+ */
+static int write_direct(struct copy_state *cs, const char *data, size_t len,
+			unsigned long long offset)
+{
+	while (len) {
+		size_t now = min(len, COMPARE_CHUNK_SIZE);
+
+		if (cs->skip_unchanged) {
+			int ret = write_changed(cs, data, now, offset);
+
+			if (ret)
+				return ret;
+		} else {
+			ssize_t w = pwrite(cs->direct, data, now, offset);
+
+			if (w <= 0) {
+				int ret = w < 0 ? -errno : -EIO;
+				image_error(cs->image, "write %zu bytes: %s\n",
+					    now, strerror(-ret));
+				return ret;
+			}
+			cs->io.writes++;
+			cs->io.written += w;
+			now = w;
+		}
+		data += now;
+		len -= now;
+		offset += now;
+	}
+
+	return 0;
+}
+
+/*
+ * Fill the aligned range of a block device like write_changed().
+ */
+static int fill_changed(struct copy_state *cs, unsigned long long size,
+			unsigned long long offset, unsigned char byte)
+{
+	size_t bufsize = min(size, COMPARE_CHUNK_SIZE);
+	void *buf;
+	int ret = 0;
+
+	if (!size)
+		return 0;
+
+	if (posix_memalign(&buf, 4096, bufsize))
+		return -ENOMEM;
+	memset(buf, byte, bufsize);
+	while (size && !ret) {
+		size_t now = min(size, bufsize);
+
+		ret = write_changed(cs, buf, now, offset);
+		size -= now;
+		offset += now;
+	}
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Fill a range of a block device. Zeros are written with BLKZEROOUT, which
+ * lets the device unmap the blocks if it guarantees that they read as
+ * zeros. Other bytes are written with O_DIRECT. Only the parts that are not
+ * aligned to the logical block size go through the page cache.
+ */
+static int fill_direct(struct copy_state *cs, unsigned long long size,
+		       unsigned long long offset, unsigned char byte)
+{
+	unsigned long long head = min(roundup(offset, cs->sector) - offset, size);
+	unsigned long long mid = rounddown(size - head, cs->sector);
+	int ret;
+
+	ret = fill_bytes(cs, cs->out, head, offset, byte);
+	if (ret)
+		return ret;
+	offset += head;
+	size -= head;
+
+	if (cs->skip_unchanged) {
+		ret = fill_changed(cs, mid, offset, byte);
+		if (ret)
+			return ret;
+		return fill_bytes(cs, cs->out, size - mid, offset + mid, byte);
+	}
+
+#ifdef BLKZEROOUT
+	if (mid && byte == 0) {
+		uint64_t range[2] = { offset, mid };
+
+		if (ioctl(cs->out, BLKZEROOUT, range) == 0) {
+			cs->io.punched += mid;
+			offset += mid;
+			size -= mid;
+			mid = 0;
+		}
+	}
+#endif
+	ret = fill_bytes(cs, cs->direct, mid, offset, byte);
+	if (ret)
+		return ret;
+
+	return fill_bytes(cs, cs->out, size - mid, offset + mid, byte);
+}
+
+/*
+ * Write @size @byte bytes at the @offset in @cs->out. Roughly equivalent to
+ * a single "pwrite(fd, big-buffer, size, offset)", except that we try to use
+ * more efficient operations (ftruncate and fallocate) if @byte is zero and
+ * reflinks of a filled block otherwise. This only uses methods that do not
+ * affect the offset of fd.
+ */
+static int write_bytes(struct copy_state *cs, size_t size, off_t offset,
+		       unsigned char byte, cfg_bool_t sparse)
+{
+	struct io_stats *io = &cs->io;
+	int fd = cs->out;
+	struct stat st;
+
+	if (!size)
+		return 0;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	if (S_ISREG(st.st_mode) && (byte == 0) && sparse) {
+		if (offset + size > (size_t)st.st_size) {
+			if (ftruncate(fd, offset + size) < 0)
+				return -errno;
+			/*
+			 * The area from st.st_size to offset+size is
+			 * zeroed by this operation. If offset was >=
+			 * st.st_size, we're done.
+			 */
+			if (offset >= st.st_size) {
+				io->skipped += size;
+				return 0;
+			}
+			io->skipped += offset + size - st.st_size;
+			/*
+			 * Otherwise, reduce size accordingly, we only
+			 * need to write bytes from offset until the
+			 * old end of the file.
+			 */
+			size = st.st_size - offset;
+		}
+#ifdef HAVE_FALLOCATE
+		/*
+		 * Use fallocate if it is available and FALLOC_FL_PUNCH_HOLE
+		 * is supported by the filesystem. If not, fall through to
+		 * the write loop.
+		 */
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      offset, size) == 0) {
+			io->punched += size;
+			return 0;
+		}
+#endif
+	}
+
+	/* Not a regular file, non-zero pattern, or fallocate not applicable. */
+	if (cs->direct >= 0)
+		return fill_direct(cs, size, offset, byte);
+
+	return fill_clone(cs, size, offset, byte);
+}
+
+/*
+ * For regular files this makes sure that:
+ * - the file exists
+ * - the file has the specified size
+ * - any previous date is cleared
+ * For block devices this makes sure that:
+ * - any existing filesystem header is cleared
+ */
+int prepare_image(struct image *image, unsigned long long size)
+{
+	int ret;
+
+	if (is_block_device(imageoutfile(image))) {
+		insert_image(image, NULL, 2048, 0, 0, 0, cfg_false);
+	} else if (size == 0) {
+		ret = unlink(imageoutfile(image));
+		if (ret < 0 && errno != ENOENT) {
+			ret = -errno;
+			image_error(image, "failed to remove %s: %s\n",
+				    imageoutfile(image), strerror(-ret));
+			return ret;
 		}
 	} else {
 		/* for regular files, create the file or truncate it to zero
@@ -574,56 +1355,825 @@ int prepare_image(struct image *image, unsigned long long size)
 }
 
 /*
- * Insert the image @sub at offset @offset in @image. If @sub is
+ * Check if @len bytes at @buf are all zero. Once the first 16 bytes are
+ * known to be zero, comparing the buffer with itself shifted by 16 bytes
+ * checks the rest with the vectorized memcmp() of the C library.
+ */
+static int is_zero(const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && i < 16; i++) {
+		if (buf[i])
+			return 0;
+	}
+	return len <= 16 || !memcmp(buf, buf + 16, len - 16);
+}
+
+#define COPY_BUF_SIZE (1024 * 1024)
+
+/*
+ * Copy @len bytes from @cs->in at @in_pos to @out at @offset through
+ * user space, with io_uring if possible. The buffers are aligned, so @out
+ * may be opened with O_DIRECT.
+ */
+static long long copy_rw(struct image *image, struct copy_state *cs, int out,
+			 unsigned long long in_pos, unsigned long long offset,
+			 unsigned long long len)
+{
+	unsigned long long done = 0;
+	struct uring *ring;
+	size_t bufsize = min(len, COPY_BUF_SIZE);
+	long long ret;
+	void *buf;
+
+	if (!len)
+		return 0;
+
+	ring = copy_ring(cs, len);
+	if (ring) {
+		ret = uring_copy(ring, cs->in, out, in_pos, offset, len, &cs->io);
+		if (ret < 0)
+			image_error(image, "copying %llu bytes from %s failed: %s\n",
+				    len, cs->infile, strerror(-ret));
+		return ret;
+	}
+
+	if (posix_memalign(&buf, 4096, bufsize))
+		return -ENOMEM;
+	while (done < len) {
+		size_t now = min(len - done, bufsize);
+		ssize_t r, w;
+
+		r = pread(cs->in, buf, now, in_pos + done);
+		if (r < 0) {
+			ret = -errno;
+			image_error(image, "reading %zu bytes from %s failed: %s\n",
+				    now, cs->infile, strerror(errno));
+			goto out;
+		}
+		if (r == 0)
+			break;
+		cs->io.read += r;
+
+		w = pwrite(out, buf, r, offset + done);
+		cs->io.writes++;
+		if (w < r) {
+			if (w < 0) {
+				ret = -errno;
+				image_error(image, "write %zd bytes: %s\n", r, strerror(errno));
+			} else {
+				ret = -EIO;
+				image_error(image, "short write (%zd vs %zd)\n", w, r);
+			}
+			goto out;
+		}
+		cs->io.written += w;
+		done += w;
+	}
+	ret = done;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Copy the aligned range to a block device like write_changed().
+ */
+static long long copy_changed(struct image *image, struct copy_state *cs,
+			      unsigned long long in_pos, unsigned long long offset,
+			      unsigned long long len)
+{
+	unsigned long long done = 0;
+	size_t bufsize = min(len, COMPARE_CHUNK_SIZE);
+	long long ret;
+	void *buf;
+
+	if (!len)
+		return 0;
+
+	if (posix_memalign(&buf, 4096, bufsize))
+		return -ENOMEM;
+	while (done < len) {
+		size_t now = min(len - done, bufsize);
+		ssize_t r;
+
+		r = pread(cs->in, buf, now, in_pos + done);
+		if (r < 0) {
+			ret = -errno;
+			image_error(image, "reading %zu bytes from %s failed: %s\n",
+				    now, cs->infile, strerror(errno));
+			goto out;
+		}
+		cs->io.read += r;
+		r = rounddown(r, cs->sector);
+		if (r == 0)
+			break;
+
+		ret = write_changed(cs, buf, r, offset + done);
+		if (ret)
+			goto out;
+		done += r;
+		if ((size_t)r < now)
+			break;
+	}
+	ret = done;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Copy to a block device: the part that is aligned to the logical block
+ * size is written with O_DIRECT, so a large image does not fill the page
+ * cache. Only the unaligned head and tail go through the page cache.
+ */
+static long long copy_direct(struct image *image, struct copy_state *cs,
+			     unsigned long long in_pos, unsigned long long offset,
+			     unsigned long long len)
+{
+	unsigned long long head = min(roundup(offset, cs->sector) - offset, len);
+	unsigned long long mid = rounddown(len - head, cs->sector);
+	unsigned long long done;
+	long long r;
+
+	r = copy_rw(image, cs, cs->out, in_pos, offset, head);
+	if (r < 0 || (unsigned long long)r < head)
+		return r;
+	done = r;
+
+	if (cs->skip_unchanged)
+		r = copy_changed(image, cs, in_pos + done, offset + done, mid);
+	else
+		r = copy_rw(image, cs, cs->direct, in_pos + done, offset + done, mid);
+	if (r < 0)
+		return r;
+	done += r;
+	if ((unsigned long long)r < mid)
+		return done;
+
+	r = copy_rw(image, cs, cs->out, in_pos + done, offset + done, len - done);
+	if (r < 0)
+		return r;
+
+	return done + r;
+}
+
+#define ZERO_BLOCK_SIZE 4096
+#define ZERO_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Copy like copy_data() but do not write blocks that only contain zeros.
+ * They are handled like holes in the input.
+ */
+static long long copy_nonzero(struct image *image, struct copy_state *cs,
+			      unsigned long long in_pos, unsigned long long offset,
+			      unsigned long long len)
+{
+	unsigned long long done = 0;
+	char *buf = xzalloc(ZERO_CHUNK_SIZE);
+	long long ret = 0;
+
+	while (done < len) {
+		size_t now = min(len - done, ZERO_CHUNK_SIZE);
+		size_t pos, end;
+		ssize_t r;
+
+		r = pread(cs->in, buf, now, in_pos + done);
+		if (r < 0) {
+			ret = -errno;
+			image_error(image, "reading %zu bytes from %s failed: %s\n",
+				    now, cs->infile, strerror(errno));
+			goto out;
+		}
+		if (r == 0)
+			break;
+		cs->io.read += r;
+
+		/* handle runs of zero and non-zero blocks at once */
+		for (pos = 0; pos < (size_t)r; pos = end) {
+			int zero = is_zero(buf + pos, min(r - pos, ZERO_BLOCK_SIZE));
+
+			end = pos + min(r - pos, ZERO_BLOCK_SIZE);
+			while (end < (size_t)r &&
+			       is_zero(buf + end, min(r - end, ZERO_BLOCK_SIZE)) == zero)
+				end += min(r - end, ZERO_BLOCK_SIZE);
+
+			if (zero) {
+				ret = write_bytes(cs, end - pos, offset + done + pos,
+						  0, cs->sparse);
+				if (ret) {
+					image_error(image, "writing %zu bytes failed: %s\n",
+						    end - pos, strerror(-ret));
+					goto out;
+				}
+				continue;
+			}
+			if (cs->direct >= 0) {
+				/* from the input again, buf is not aligned */
+				ret = copy_direct(image, cs, in_pos + done + pos,
+						  offset + done + pos, end - pos);
+				if (ret < 0)
+					goto out;
+				if ((size_t)ret < end - pos) {
+					ret = -EIO;
+					goto out;
+				}
+				continue;
+			}
+			while (pos < end) {
+				ssize_t w = pwrite(cs->out, buf + pos, end - pos,
+						   offset + done + pos);
+
+				if (w <= 0) {
+					ret = w < 0 ? -errno : -EIO;
+					image_error(image, "write %zu bytes: %s\n",
+						    end - pos, strerror(-ret));
+					goto out;
+				}
+				cs->io.writes++;
+				cs->io.written += w;
+				pos += w;
+			}
+		}
+		done += r;
+	}
+	ret = done;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Copy @len bytes from @cs->in at @in_pos to @cs->out at @offset. The
+ * block aligned part is shared with FICLONERANGE if both files are on the
+ * same reflink capable filesystem, the rest is copied by the kernel with
+ * copy_file_range() and only if that fails a read/write loop is used. A
+ * method that fails is not tried again for the following extents.
+ * Returns the number of bytes copied, which is less than @len only at the
+ * end of the input file, or a negative error code.
+ */
+static long long copy_data(struct image *image, struct copy_state *cs,
+			   unsigned long long in_pos, unsigned long long offset,
+			   unsigned long long len)
+{
+	unsigned long long done = 0;
+	long long r;
+
+	if (in_pos >= cs->in_size)
+		return 0;
+	len = min(len, cs->in_size - in_pos);
+
+	if (cs->detect_zeros && cs->sparse)
+		return copy_nonzero(image, cs, in_pos, offset, len);
+
+#ifdef FICLONERANGE
+	if (cs->blksize && !(in_pos % cs->blksize) && !(offset % cs->blksize) &&
+	    len >= cs->blksize) {
+		struct file_clone_range range = {
+			.src_fd = cs->in,
+			.src_offset = in_pos,
+			.src_length = rounddown(len, cs->blksize),
+			.dest_offset = offset,
+		};
+
+		if (ioctl(cs->out, FICLONERANGE, &range) == 0) {
+			cs->io.cloned += range.src_length;
+			done = range.src_length;
+		} else {
+			image_debug(image, "FICLONERANGE failed: %s\n", strerror(errno));
+			cs->blksize = 0;
+		}
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	while (done < len && !cs->no_copy_range) {
+		loff_t in_off = in_pos + done, out_off = offset + done;
+
+		r = copy_file_range(cs->in, &in_off, cs->out, &out_off,
+				    len - done, 0);
+		if (r <= 0) {
+			if (r < 0)
+				image_debug(image, "copy_file_range failed: %s\n",
+					    strerror(errno));
+			cs->no_copy_range = 1;
+			break;
+		}
+		cs->io.read += r;
+		cs->io.written += r;
+		done += r;
+	}
+#endif
+	if (cs->direct >= 0)
+		r = copy_direct(image, cs, in_pos + done, offset + done, len - done);
+	else
+		r = copy_rw(image, cs, cs->out, in_pos + done, offset + done, len - done);
+	if (r < 0)
+		return r;
+
+	return done + r;
+}
+
+/* a small write that is delayed until the writer is flushed */
+struct pending_write {
+	unsigned long long offset;
+	size_t size;
+	void *data;
+};
+
+/*
+ * A writer keeps the output file of an image open while a handler writes
+ * it. Small writes like partition tables and superblocks are collected
+ * and written with one pwritev() per contiguous range when the writer is
+ * closed, followed by a single fsync.
+ */
+struct image_writer {
+	struct image *image;
+	struct copy_state cs;
+	/* block size of the output for FICLONERANGE, 0 if not a file */
+	unsigned long blksize;
+	struct pending_write *pending;
+	unsigned int num_pending;
+	unsigned long long pending_end;
+};
+
+int writer_open(struct image *image, struct image_writer **writer)
+{
+	struct image_writer *w;
+	struct stat st;
+	int fd;
+
+	fd = open_file(image, imageoutfile(image), 0);
+	if (fd < 0)
+		return fd;
+
+	w = xzalloc(sizeof(*w));
+	w->image = image;
+	w->cs.image = image;
+	w->cs.in = -1;
+	w->cs.out = fd;
+	w->cs.direct = -1;
+	stream_open(&w->cs.out_stream, fd, 1);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		w->blksize = st.st_blksize;
+#if defined(HAVE_LINUX_FS_H) && defined(O_DIRECT)
+	if (S_ISBLK(st.st_mode)) {
+		int sector;
+
+		/* the data on the device is read to compare it with the image */
+		w->cs.skip_unchanged = get_skip_unchanged();
+		/* fd holds the O_EXCL claim, so this cannot use O_EXCL */
+		w->cs.direct = open(imageoutfile(image),
+				    (w->cs.skip_unchanged ? O_RDWR : O_WRONLY) | O_DIRECT);
+		if (w->cs.direct < 0 && w->cs.skip_unchanged) {
+			int ret = -errno;
+
+			image_error(image, "open %s with O_DIRECT for skip-unchanged: %s\n",
+				    imageoutfile(image), strerror(errno));
+			close(fd);
+			free(w);
+			return ret;
+		}
+		if (w->cs.direct < 0)
+			image_debug(image, "open %s with O_DIRECT: %s\n",
+				    imageoutfile(image), strerror(errno));
+		if (ioctl(fd, BLKSSZGET, &sector) < 0 || sector <= 0)
+			sector = 512;
+		w->cs.sector = sector;
+	}
+#endif
+	*writer = w;
+
+	return 0;
+}
+
+static int pending_cmp(const void *a, const void *b)
+{
+	const struct pending_write *pa = a, *pb = b;
+
+	if (pa->offset == pb->offset)
+		return 0;
+	return pa->offset < pb->offset ? -1 : 1;
+}
+
+static int writer_flush(struct image_writer *w)
+{
+	struct iovec iov[64];
+	unsigned int i, j, n;
+	int ret = 0;
+
+	qsort(w->pending, w->num_pending, sizeof(*w->pending), pending_cmp);
+
+	for (i = 0; i < w->num_pending; i = j) {
+		unsigned long long end = w->pending[i].offset;
+		ssize_t r;
+
+		for (j = i, n = 0; j < w->num_pending && n < ARRAY_SIZE(iov) &&
+				   w->pending[j].offset == end; j++, n++) {
+			iov[n].iov_base = w->pending[j].data;
+			iov[n].iov_len = w->pending[j].size;
+			end += w->pending[j].size;
+		}
+		r = pwritev(w->cs.out, iov, n, w->pending[i].offset);
+		if (r < 0 || (unsigned long long)r < end - w->pending[i].offset) {
+			ret = r < 0 ? -errno : -EIO;
+			image_error(w->image, "write %s: %s\n",
+				    imageoutfile(w->image), strerror(-ret));
+			break;
+		}
+		w->cs.io.writes++;
+		w->cs.io.written += r;
+	}
+
+	for (i = 0; i < w->num_pending; i++)
+		free(w->pending[i].data);
+	free(w->pending);
+	w->pending = NULL;
+	w->num_pending = 0;
+	w->pending_end = 0;
+
+	return ret;
+}
+
+/*
+ * Pending writes are flushed before anything else is written to the
+ * same range, so the order of overlapping writes is kept.
+ */
+static int writer_prepare(struct image_writer *w, unsigned long long offset,
+			  unsigned long long size)
+{
+	unsigned int i;
+
+	for (i = 0; i < w->num_pending; i++) {
+		const struct pending_write *p = &w->pending[i];
+
+		if (offset < p->offset + p->size && p->offset < offset + size)
+			return writer_flush(w);
+	}
+
+	return 0;
+}
+
+/*
+ * Close the writer: write the pending data and sync the output once.
+ */
+int writer_close(struct image_writer *w)
+{
+	int ret;
+
+	ret = writer_flush(w);
+	stats_add_io(w->image, &w->cs.io);
+	uring_close(w->cs.ring);
+	if (w->cs.direct >= 0)
+		close(w->cs.direct);
+	free(w->cs.cmp_buf);
+	stream_close(&w->cs.out_stream);
+	if (fsync_close(w->image, w->cs.out) && !ret)
+		ret = -EIO;
+	free(w);
+
+	return ret;
+}
+
+/*
+ * Write @size bytes of @data at @offset. The data is copied and written
+ * together with other small writes when the writer is closed.
+ */
+int writer_insert_data(struct image_writer *w, const void *data, size_t size,
+		       unsigned long long offset)
+{
+	struct pending_write *p;
+	int ret;
+
+	ret = writer_prepare(w, offset, size);
+	if (ret)
+		return ret;
+
+	w->pending = xrealloc(w->pending, (w->num_pending + 1) * sizeof(*p));
+	p = &w->pending[w->num_pending++];
+	p->offset = offset;
+	p->size = size;
+	p->data = xzalloc(size);
+	memcpy(p->data, data, size);
+	if (offset + size > w->pending_end)
+		w->pending_end = offset + size;
+
+	return 0;
+}
+
+/*
+ * Like write_bytes() but in windows of STREAM_WINDOW bytes when streaming.
+ */
+static int fill_range(struct copy_state *cs, unsigned long long size,
+		      unsigned long long offset, unsigned char byte,
+		      cfg_bool_t sparse)
+{
+	unsigned long long chunk = cs->out_stream.fd >= 0 ? STREAM_WINDOW : size;
+	int ret = 0;
+
+	while (size && !ret) {
+		unsigned long long len = min(size, chunk);
+
+		ret = write_bytes(cs, len, offset, byte, sparse);
+		size -= len;
+		offset += len;
+		stream_advance(&cs->out_stream, offset);
+	}
+
+	return ret;
+}
+
+/*
+ * Write @size bytes of the repeated 32 bit @value at @offset, starting with
+ * byte @phase of @value. Values with four equal bytes are handled like
+ * fill_range(). On a block device, the aligned part is written like
+ * fill_direct().
+ */
+static int fill_pattern(struct copy_state *cs, unsigned long long size,
+			unsigned long long offset, uint32_t value,
+			unsigned int phase)
+{
+	const unsigned char *bytes = (const unsigned char *)&value;
+	size_t bufsize = min(size, FILL_BUF_SIZE);
+	unsigned int buf_phase = sizeof(value);
+	char *buf;
+	size_t i;
+	int ret = 0;
+
+	if (bytes[0] == bytes[1] && bytes[0] == bytes[2] && bytes[0] == bytes[3])
+		return fill_range(cs, size, offset, bytes[0], cs->sparse);
+
+	if (posix_memalign((void **)&buf, 4096, bufsize))
+		return -ENOMEM;
+	while (size) {
+		size_t now = min(size, bufsize);
+		unsigned long long head;
+		ssize_t r;
+
+		/* the buffer starts with byte @phase of @value */
+		if (buf_phase != phase) {
+			for (i = 0; i < bufsize; i++)
+				buf[i] = bytes[(phase + i) % sizeof(value)];
+			buf_phase = phase;
+		}
+
+		head = cs->direct >= 0 ? roundup(offset, cs->sector) - offset : 0;
+		if (cs->direct >= 0 && !head && now >= cs->sector) {
+			now = rounddown(now, cs->sector);
+			ret = write_direct(cs, buf, now, offset);
+			if (ret)
+				break;
+			r = now;
+		} else {
+			if (head)
+				now = min(now, head);
+			r = pwrite(cs->out, buf, now, offset);
+			if (r <= 0) {
+				ret = r < 0 ? -errno : -EIO;
+				break;
+			}
+			cs->io.writes++;
+			cs->io.written += r;
+		}
+		size -= r;
+		offset += r;
+		phase = (phase + r) % sizeof(value);
+		stream_advance(&cs->out_stream, offset);
+	}
+	free(buf);
+
+	return ret;
+}
+
+static int sparse_read_header(struct image *image, const char *filename, int fd,
+			      struct sparse_header *header)
+{
+	ssize_t r;
+
+	r = pread(fd, header, sizeof(*header), 0);
+	if (r < 0) {
+		int ret = -errno;
+
+		image_error(image, "read %s: %s\n", filename, strerror(errno));
+		return ret;
+	}
+	if (r != sizeof(*header) || le32toh(header->magic) != SPARSE_MAGIC ||
+	    le16toh(header->major_version) != 1 ||
+	    le16toh(header->header_size) < sizeof(*header) ||
+	    le16toh(header->chunk_header_size) < sizeof(struct sparse_chunk_header) ||
+	    !le32toh(header->block_size) || le32toh(header->block_size) % 4) {
+		image_error(image, "%s is not a valid android sparse image\n", filename);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the size of the data in the android sparse image @filename.
+ */
+int sparse_image_size(struct image *image, const char *filename,
+		      unsigned long long *size)
+{
+	struct sparse_header header;
+	int fd, ret;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", filename, strerror(errno));
+		return ret;
+	}
+	ret = sparse_read_header(image, filename, fd, &header);
+	close(fd);
+	if (ret)
+		return ret;
+
+	*size = (unsigned long long)le32toh(header.output_blocks) *
+		le32toh(header.block_size);
+
+	return 0;
+}
+
+/*
+ * Insert the range [@imageoffset, @imageoffset + @size) of the data of the
+ * android sparse image @cs->in at @offset. Raw chunks are copied, fill
+ * chunks are written as a pattern and "don't care" chunks are handled like
+ * holes. Returns the number of bytes that were covered by the chunks.
+ */
+static long long insert_sparse(struct copy_state *cs, unsigned long long size,
+			       unsigned long long offset,
+			       unsigned long long imageoffset)
+{
+	struct image *image = cs->image;
+	struct sparse_header header;
+	struct sparse_chunk_header chunk;
+	unsigned long long pos = 0, end = imageoffset + size, in_pos;
+	uint32_t block_size, chunk_header_size, i;
+	int ret;
+
+	ret = sparse_read_header(image, cs->infile, cs->in, &header);
+	if (ret)
+		return ret;
+	block_size = le32toh(header.block_size);
+	chunk_header_size = le16toh(header.chunk_header_size);
+	in_pos = le16toh(header.header_size);
+
+	for (i = 0; i < le32toh(header.input_chunks) && pos < end; i++) {
+		unsigned long long len, data, start, stop;
+		uint32_t chunk_size, value;
+		long long r;
+
+		r = pread(cs->in, &chunk, sizeof(chunk), in_pos);
+		if (r != sizeof(chunk))
+			goto invalid;
+		len = (unsigned long long)le32toh(chunk.blocks) * block_size;
+		chunk_size = le32toh(chunk.size);
+		data = in_pos + chunk_header_size;
+		in_pos += chunk_size;
+
+		/* the part of the chunk that is inserted */
+		start = pos > imageoffset ? pos : imageoffset;
+		stop = pos + len < end ? pos + len : end;
+
+		if (chunk.chunk_type == SPARSE_RAW) {
+			if (chunk_size != chunk_header_size + len)
+				goto invalid;
+			if (start < stop) {
+				r = copy_data(image, cs, data + start - pos,
+					      offset + start - imageoffset, stop - start);
+				if (r < 0)
+					return r;
+				if ((unsigned long long)r < stop - start)
+					goto invalid;
+			}
+		} else if (chunk.chunk_type == SPARSE_FILL) {
+			if (chunk_size != chunk_header_size + sizeof(value))
+				goto invalid;
+			if (pread(cs->in, &value, sizeof(value), data) != sizeof(value))
+				goto invalid;
+			if (start < stop) {
+				ret = fill_pattern(cs, stop - start, offset + start - imageoffset,
+						   value, (start - pos) % sizeof(value));
+				if (ret)
+					return ret;
+			}
+		} else if (chunk.chunk_type == SPARSE_DONT_CARE) {
+			if (chunk_size != chunk_header_size)
+				goto invalid;
+			/* Assumes "don't care" is always 0 bytes, like holes */
+			if (start < stop) {
+				ret = fill_range(cs, stop - start, offset + start - imageoffset,
+						 0, cs->sparse);
+				if (ret)
+					return ret;
+			}
+		} else if (chunk.chunk_type != SPARSE_CRC32) {
+			goto invalid;
+		}
+		pos += len;
+		stream_advance(&cs->in_stream, in_pos);
+		if (start < stop)
+			stream_advance(&cs->out_stream, offset + stop - imageoffset);
+	}
+
+	if (pos <= imageoffset)
+		return 0;
+	return (pos < end ? pos : end) - imageoffset;
+
+invalid:
+	image_error(image, "%s: chunk %u of the sparse image is invalid\n",
+		    cs->infile, i);
+	return -EINVAL;
+}
+
+/*
+ * Insert the image @sub at offset @offset in the output of @w. If @sub is
  * smaller than @size (including if @sub is NULL), insert @byte bytes for
  * the remainder. If @sub is larger than @size, only the first @size
  * bytes of it will be copied (it's up to the caller to ensure this
  * doesn't happen). This means that after this call, exactly the range
- * [offset, offset+size) in the output @image have been updated.
+ * [offset, offset+size) in the output image have been updated.
+ * With @detect_zeros and @sparse, blocks of zeros in @sub are treated
+ * like holes. If @sub is an android sparse image, its data is inserted.
  */
-int insert_image(struct image *image, struct image *sub,
-		 unsigned long long size, unsigned long long offset,
-		 unsigned long long imageoffset,
-		 unsigned char byte, cfg_bool_t sparse)
+int writer_insert_image(struct image_writer *w, struct image *sub,
+			unsigned long long size, unsigned long long offset,
+			unsigned long long imageoffset,
+			unsigned char byte, cfg_bool_t sparse,
+			cfg_bool_t detect_zeros)
 {
-	struct extent *extents = NULL;
-	size_t extent_count = 0;
-	int fd = -1, in_fd = -1;
+	struct image *image = w->image;
+	struct copy_state *cs = &w->cs;
+	struct extent_iter it = {};
+	struct extent ext;
 	unsigned long long in_pos;
-	const char *infile;
-	unsigned e;
+	const char *infile = NULL;
+	unsigned long long start = trace_now(), total = size, out_offset = offset;
+	/* copy in windows when streaming, so the cache can be dropped */
+	unsigned long long chunk = cs->out_stream.fd >= 0 ? STREAM_WINDOW : ULLONG_MAX;
+	struct stat st;
 	int ret;
 
-	fd = open_file(image, imageoutfile(image), 0);
-	if (fd < 0) {
-		ret = fd;
-		goto out;
-	}
-	if (lseek(fd, offset, SEEK_SET) < 0) {
-		ret = -errno;
+	ret = writer_prepare(w, offset, size);
+	if (ret)
 		goto out;
-	}
+	stream_seek(&cs->out_stream, offset);
+	/* these depend on the input, so try them again for each image */
+	cs->blksize = w->blksize;
+	/* copy_file_range() needs regular files, only those have a blksize */
+	cs->no_copy_range = !w->blksize;
 	if (!sub)
 		goto fill;
 
 	infile = imageoutfile(sub);
-	in_fd = open(infile, O_RDONLY);
-	if (in_fd < 0) {
+	cs->in = open(infile, O_RDONLY);
+	if (cs->in < 0) {
 		ret = -errno;
 		image_error(image, "open %s: %s", infile, strerror(errno));
 		goto out;
 	}
-	ret = map_file_extents(image, infile, in_fd, size + imageoffset, &extents, &extent_count);
-	if (ret)
+	stream_open(&cs->in_stream, cs->in, 0);
+	stream_seek(&cs->in_stream, imageoffset);
+	if (fstat(cs->in, &st) < 0) {
+		ret = -errno;
+		image_error(image, "stat %s: %s\n", infile, strerror(errno));
 		goto out;
+	}
+	cs->infile = infile;
+	cs->in_size = S_ISREG(st.st_mode) ? (unsigned long long)st.st_size : ULLONG_MAX;
+	cs->sparse = sparse;
+	cs->detect_zeros = detect_zeros;
+
+	if (sub->sparse_input) {
+		long long r;
+
+		image_debug(image, "decoding %llu bytes from %s from offset %llu to offset %llu\n",
+			    size, infile, imageoffset, offset);
+		stream_seek(&cs->in_stream, 0);
+		r = insert_sparse(cs, size, offset, imageoffset);
+		if (r < 0) {
+			ret = r;
+			goto out;
+		}
+		size -= r;
+		offset += r;
+		goto fill;
+	}
+
+	extent_iter_init(&it, image, infile, cs->in, imageoffset, size + imageoffset);
 	image_debug(image, "copying %llu bytes from %s from offset %llu to offset %llu\n",
 		    size, infile, imageoffset, offset);
 	in_pos = imageoffset;
-	for (e = 0; e < extent_count && size > 0; e++) {
-		const struct extent *ext = &extents[e];
+	while (size > 0) {
+		ret = extent_iter_next(&it, &ext);
+		if (ret < 0)
+			goto out;
+		if (!ret)
+			break;
 
-		if (in_pos < ext->start) {
-			size_t len = ext->start - in_pos;
+		if (in_pos < ext.start) {
+			size_t len = ext.start - in_pos;
 
 			/*
 			 * If the input file is larger than size, it might
@@ -631,7 +2181,7 @@ int insert_image(struct image *image, struct image *sub,
 			 */
 			len = min(len, size);
 			/* Assumes 'holes' are always 0 bytes */
-			ret = write_bytes(fd, len, offset, 0, sparse);
+			ret = fill_range(cs, len, offset, 0, sparse);
 			if (ret) {
 				image_error(image, "writing %zu bytes failed: %s\n",
 					    len, strerror(-ret));
@@ -640,59 +2190,114 @@ int insert_image(struct image *image, struct image *sub,
 			size -= len;
 			offset += len;
 			in_pos += len;
+			stream_seek(&cs->in_stream, in_pos);
 		}
-		while (in_pos < ext->end && size > 0) {
-			char buf[4096];
-			size_t now;
-			int r, w;
+		while (in_pos < ext.end && size > 0) {
+			unsigned long long len = min(min(ext.end - in_pos, size), chunk);
+			long long r;
 
-			now = min(ext->end - in_pos, sizeof(buf));
-			now = min(now, size);
-			r = pread(in_fd, buf, now, in_pos);
+			r = copy_data(image, cs, in_pos, offset, len);
 			if (r < 0) {
-				ret = -errno;
-				image_error(image, "reading %zu bytes from %s failed: %s\n",
-					    now, infile, strerror(errno));
-				goto out;
-			}
-			if (r == 0)
-				break;
-
-			w = pwrite(fd, buf, r, offset);
-			if (w < r) {
-				ret = w < 0 ? -errno : -EIO;
-				if (w < 0)
-					image_error(image, "write %d bytes: %s\n", r, strerror(errno));
-				else
-					image_error(image, "short write (%d vs %d)\n", w, r);
+				ret = r;
 				goto out;
 			}
-			size -= w;
-			offset += w;
-			in_pos += w;
+			size -= r;
+			offset += r;
+			in_pos += r;
+			stream_advance(&cs->in_stream, in_pos);
+			stream_advance(&cs->out_stream, offset);
+			/* end of the input file */
+			if ((unsigned long long)r < len)
+				goto fill;
 		}
 	}
 
 fill:
 	image_debug(image, "adding %llu %#hhx bytes at offset %llu\n",
 		    size, byte, offset);
-	ret = write_bytes(fd, size, offset, byte, sparse);
+	ret = fill_range(cs, size, offset, byte, sparse);
 	if (ret)
 		image_error(image, "writing %llu bytes failed: %s\n", size, strerror(-ret));
 
 out:
-	if (fd >= 0)
-		fsync_close(image, fd);
-	if (in_fd >= 0)
-		close(in_fd);
-	free(extents);
+	if (cs->in >= 0) {
+		stream_close(&cs->in_stream);
+		close(cs->in);
+	}
+	cs->in = -1;
+	extent_iter_free(&it);
+	if (trace_enabled()) {
+		char *jimage = json_string(image->file);
+		char *jfile = json_string(infile);
+
+		trace_span(start, "io", "insert_image",
+			   "\"image\":%s,\"input\":%s,\"bytes\":%llu,\"offset\":%llu",
+			   jimage, jfile, total, out_offset);
+		free(jimage);
+		free(jfile);
+	}
 	return ret;
 }
 
+/*
+ * Extend the output of @w to @size bytes. The new space reads as zeros.
+ */
+int writer_extend(struct image_writer *w, unsigned long long size)
+{
+	struct image *image = w->image;
+	unsigned long long cur;
+	off_t offset;
+
+	offset = lseek(w->cs.out, 0, SEEK_END);
+	if (offset < 0) {
+		int ret = -errno;
+
+		image_error(image, "seek: %s\n", strerror(errno));
+		return ret;
+	}
+	cur = offset;
+	if (w->pending_end > cur)
+		cur = w->pending_end;
+	if (cur > size) {
+		image_error(image, "output file is larger than requested size\n");
+		return -EINVAL;
+	}
+	if (cur == size)
+		return 0;
+
+	if (ftruncate(w->cs.out, size) < 0) {
+		int ret = -errno;
+
+		image_error(image, "ftruncate %s: %s\n", imageoutfile(image),
+			    strerror(errno));
+		return ret;
+	}
+	w->cs.io.skipped += size - cur;
+
+	return 0;
+}
+
+int insert_image(struct image *image, struct image *sub,
+		 unsigned long long size, unsigned long long offset,
+		 unsigned long long imageoffset,
+		 unsigned char byte, cfg_bool_t sparse)
+{
+	struct image_writer *w;
+	int ret;
+
+	ret = writer_open(image, &w);
+	if (ret)
+		return ret;
+	ret = writer_insert_image(w, sub, size, offset, imageoffset, byte, sparse,
+				  get_detect_zeros());
+	return writer_close(w) ?: ret;
+}
+
 int insert_data(struct image *image, const void *_data, const char *outfile,
 		size_t size, unsigned long long offset)
 {
 	const char *data = _data;
+	struct io_stats io = { 0 };
 	int outf = -1;
 	int now, r;
 	int ret = 0;
@@ -715,50 +2320,99 @@ int insert_data(struct image *image, const void *_data, const char *outfile,
 			image_error(image, "write %s: %s\n", outfile, strerror(errno));
 			goto err_out;
 		}
+		io.writes++;
+		io.written += r;
 		size -= now;
 		data += now;
 	}
 err_out:
+	stats_add_io(image, &io);
 	fsync_close(image, outf);
 
 	return ret;
 }
 
-int extend_file(struct image *image, size_t size)
+static int copy_range(int in, int out, off_t offset, off_t len)
 {
-	const char *outfile = imageoutfile(image);
-	int f;
-	off_t offset;
-	int ret = 0;
+	char buf[65536];
+	ssize_t r, w;
 
-	f = open_file(image, outfile, 0);
-	if (f < 0)
-		return f;
+#ifdef HAVE_COPY_FILE_RANGE
+	while (len > 0) {
+		loff_t in_off = offset, out_off = offset;
 
-	offset = lseek(f, 0, SEEK_END);
-	if (offset < 0) {
-		ret = -errno;
-		image_error(image, "seek: %s\n", strerror(errno));
-		goto out;
+		r = copy_file_range(in, &in_off, out, &out_off, len, 0);
+		if (r <= 0)
+			break;
+		offset += r;
+		len -= r;
 	}
-	if ((size_t)offset > size) {
-		ret = -EINVAL;
-		image_error(image, "output file is larger than requested size\n");
-		goto out;
+	if (!len)
+		return 0;
+#endif
+	while (len > 0) {
+		r = pread(in, buf, min(len, sizeof(buf)), offset);
+		if (r <= 0)
+			return r < 0 ? -errno : -EIO;
+		w = pwrite(out, buf, r, offset);
+		if (w != r)
+			return w < 0 ? -errno : -EIO;
+		offset += r;
+		len -= r;
 	}
-	if ((size_t)offset == size)
-		goto out;
+	return 0;
+}
 
-	ret = ftruncate(f, size);
-	if (ret == -1) {
-		ret = -errno;
-		image_error(image, "ftruncate %s: %s\n", outfile, strerror(errno));
-		goto out;
+/*
+ * copy the first @size bytes of @in to @out. The data is shared with a
+ * reflink if the filesystem supports it. Otherwise only the data regions
+ * are copied, so holes are preserved.
+ */
+int copy_fd(int in, int out, off_t size)
+{
+	off_t pos = 0, data, hole;
+	int ret;
+
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0)
+		return 0;
+#endif
+	while (pos < size) {
+		data = lseek(in, pos, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break;
+			/* SEEK_DATA is not supported: copy everything */
+			data = pos;
+			hole = size;
+		} else {
+			hole = lseek(in, data, SEEK_HOLE);
+			if (hole < 0 || hole > size)
+				hole = size;
+		}
+		if (data >= size)
+			break;
+		ret = copy_range(in, out, data, hole - data);
+		if (ret)
+			return ret;
+		pos = hole;
 	}
-	ret = 0;
-out:
-	fsync_close(image, f);
-	return ret;
+	if (ftruncate(out, size))
+		return -errno;
+
+	return 0;
+}
+
+int extend_file(struct image *image, size_t size)
+{
+	struct image_writer *w;
+	int ret;
+
+	ret = writer_open(image, &w);
+	if (ret)
+		return ret;
+	ret = writer_extend(w, size);
+	return writer_close(w) ?: ret;
 }
 
 int uuid_validate(const char *str)